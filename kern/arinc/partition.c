@@ -0,0 +1,348 @@
+#include <partition.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <ppool.h>
+#include <shm.h>
+#include <process.h>
+#include <mmu.h>
+#include <assert.h>
+#include <stdio.h>
+#include <error.h>
+#include <x86.h>
+
+
+static partition_t partitions[MAX_NUMBER_OF_PARTITIONS];
+
+static void check_partition(void);
+
+void partition_init(void) {
+    for (int i=0; i<MAX_NUMBER_OF_PARTITIONS; ++i)
+        partitions[i].id = -1;
+
+    check_partition();
+}
+
+partition_t *partition_create(int id, size_t pages, size_t quota,
+                                uint32_t colors, partition_init_t init) {
+    if (id < 0 || id >= MAX_NUMBER_OF_PARTITIONS || init == NULL)
+        return NULL;
+
+    partition_t *part = partitions + id;
+    if (part->id >= 0) {
+        warn("partition %d exist.\n", id);
+        return NULL;
+    }
+
+    if (colors)
+        part->pool = ppool_create_colored(id, pages, quota, colors);
+    else
+        part->pool = ppool_create(id, pages, quota);
+    if (part->pool == NULL)
+        return NULL;
+
+    part->id = id;
+    part->mode = IDLE;
+    part->start_cond = NORMAL_START;
+    part->mm = NULL;
+    part->init = init;
+    part->nr_cold = part->nr_warm = 0;
+    part->last_dirty = 0;
+    return part;
+}
+
+// no partition process yet, the calling task runs the partition and
+// takes its faults
+static void partition_bind(partition_t *part) {
+    current_thread->mm = part->mm;
+    mm_switch(part->mm);
+}
+
+static void partition_release_mm(partition_t *part) {
+    if (part->mm) {
+        if (current_thread->mm == part->mm) {
+            current_thread->mm = NULL;
+            mm_switch(NULL);
+        }
+        mm_destroy(part->mm);
+        part->mm = NULL;
+    }
+}
+
+void partition_destroy(partition_t *part) {
+    ASSERT(part && part->id >= 0);
+
+    partition_release_mm(part);
+    ppool_destroy(part->pool);
+
+    part->pool = NULL;
+    part->id = -1;
+}
+
+partition_t *partition_get(int id) {
+    if (id < 0 || id >= MAX_NUMBER_OF_PARTITIONS || partitions[id].id < 0)
+        return NULL;
+    return partitions + id;
+}
+
+// new address space from the pool, init builds it again
+static return_code_t partition_cold_start(partition_t *part) {
+    partition_release_mm(part);
+
+    if ((part->mm = mm_create()) == NULL)
+        goto failed;
+    part->mm->pool = part->pool;
+    partition_bind(part);
+
+    // configured shared regions are there before init runs
+    if (shm_attach_partition(part) != 0)
+        goto failed;
+
+    part->mode = COLD_START;
+    part->nr_cold++;
+    // VM_PREFAULT vmas are backed before NORMAL, they never fault there
+    if (part->init(part) != 0 || mm_prefault(part->mm) != 0)
+        goto failed;
+    return NO_ERROR;
+
+failed:
+    partition_release_mm(part);
+    part->mode = IDLE;
+    return NOT_AVAILABLE;
+}
+
+// only the pages written since NORMAL go back, init does not run
+static return_code_t partition_warm_start(partition_t *part) {
+    vmm_t *mm = part->mm;
+
+    if (mm == NULL || mm->snap == NULL)
+        return partition_cold_start(part);
+
+    part->last_dirty = mm->snap->nr_dirty;
+    if (mm_rollback(mm) != 0)
+        return partition_cold_start(part);
+
+    partition_bind(part);
+    part->mode = WARM_START;
+    part->nr_warm++;
+    return NO_ERROR;
+}
+
+return_code_t partition_set_mode(partition_t *part, operating_mode_t mode,
+                                                    start_condition_t cond) {
+    if (part == NULL || part->id < 0)
+        return INVALID_PARAM;
+
+    switch (mode)
+    {
+    case NORMAL:
+        if (part->mode == NORMAL)
+            return NO_ACTION;
+        if (part->mm == NULL)
+            return INVALID_MODE;
+        // the first time the init is done, later ones keep that image
+        if (part->mm->snap == NULL && mm_snapshot(part->mm) != 0)
+            return NOT_AVAILABLE;
+        part->mode = NORMAL;
+        return NO_ERROR;
+
+    case IDLE:
+        partition_release_mm(part);
+        part->mode = IDLE;
+        return NO_ERROR;
+
+    case COLD_START:
+        part->start_cond = cond;
+        return partition_cold_start(part);
+
+    case WARM_START:
+        if (part->mode == COLD_START)
+            return INVALID_MODE;
+        part->start_cond = cond;
+        return partition_warm_start(part);
+
+    default:
+        return INVALID_PARAM;
+    }
+}
+
+
+/*
+partition test area
+*/
+
+#define CHECK_PART_BASE     (4 * PTSIZE)
+#define CHECK_PART_PAGES    10
+#define CHECK_PART_INIT     8
+
+static uint32_t check_part_inits;
+
+static int check_part_init(partition_t *part) {
+    vma_t *vma = vma_create(CHECK_PART_BASE,
+                CHECK_PART_BASE + CHECK_PART_PAGES * PAGE_SIZE,
+                VM_READ | VM_WRITE);
+    if (vma == NULL || vma_add(part->mm, vma) != 0)
+        return E_NO_MEM;
+
+    for (int i=0; i<CHECK_PART_INIT; ++i)
+        *(int*)(CHECK_PART_BASE + i * PAGE_SIZE) = 100 + i;
+
+    check_part_inits++;
+    return 0;
+}
+
+#define CHECK_PREFAULT_PAGES    4
+
+static int check_prefault_init(partition_t *part) {
+    vma_t *vma = vma_create(CHECK_PART_BASE,
+                CHECK_PART_BASE + CHECK_PREFAULT_PAGES * PAGE_SIZE,
+                VM_READ | VM_WRITE | VM_PREFAULT);
+    if (vma == NULL || vma_add(part->mm, vma) != 0)
+        return E_NO_MEM;
+
+    *(int*)CHECK_PART_BASE = 100;
+    return 0;
+}
+
+// no fault in NORMAL, a warm start still brings back the image
+static void check_partition_prefault(void) {
+    partition_t *part = partition_create(0, 16, 0, 0, check_prefault_init);
+    ASSERT(part);
+
+    ASSERT(partition_set_mode(part, COLD_START, NORMAL_START) == NO_ERROR);
+    ASSERT(part->pool->used == CHECK_PREFAULT_PAGES);
+    vma_t *vma = find_vma(part->mm, CHECK_PART_BASE);
+    uint32_t nr_fault = vma->nr_fault;
+
+    ASSERT(partition_set_mode(part, NORMAL, NORMAL_START) == NO_ERROR);
+    ASSERT(part->mm->snap->nr_copies == CHECK_PREFAULT_PAGES);
+    ASSERT(part->mm->snap->dirty_cap == 0);
+
+    int *t = (int*)CHECK_PART_BASE;
+    for (int i=0; i<CHECK_PREFAULT_PAGES; ++i) {
+        ASSERT(t[i * PAGE_SIZE / sizeof(int)] == (i ? 0 : 100));
+        t[i * PAGE_SIZE / sizeof(int)] = -i - 1;
+    }
+    ASSERT(vma->nr_fault == nr_fault && part->mm->snap->nr_dirty == 0);
+
+    ASSERT(partition_set_mode(part, WARM_START,
+                                    PARTITION_RESTART) == NO_ERROR);
+    for (int i=0; i<CHECK_PREFAULT_PAGES; ++i)
+        ASSERT(t[i * PAGE_SIZE / sizeof(int)] == (i ? 0 : 100));
+    ASSERT(part->pool->used == 2 * CHECK_PREFAULT_PAGES);
+
+    ASSERT(partition_set_mode(part, IDLE, NORMAL_START) == NO_ERROR);
+    ASSERT(part->pool->used == 0);
+    partition_destroy(part);
+}
+
+// a 2M span from a plain pool, the image copies it and it stays writable
+static int check_huge_init(partition_t *part) {
+    vma_t *vma = vma_create(CHECK_PART_BASE, CHECK_PART_BASE + PTSIZE,
+                VM_READ | VM_WRITE | VM_HUGE);
+    if (vma == NULL || vma_add(part->mm, vma) != 0)
+        return E_NO_MEM;
+
+    *(int*)CHECK_PART_BASE = 100;
+    return 0;
+}
+
+static void check_partition_huge(void) {
+    buddy_stat_t st;
+    const int last = (PTSIZE - sizeof(int)) / sizeof(int);
+
+    // the pool takes a 4M block, the span and its copy in the image
+    if (zone_stat(ZONE_USER, &st) != 0 || st.largest < 2 * NPTEENTRY)
+        return;
+
+    partition_t *part = partition_create(0, 2 * NPTEENTRY, 0, 0,
+                                                    check_huge_init);
+    ASSERT(part);
+
+    ASSERT(partition_set_mode(part, COLD_START, NORMAL_START) == NO_ERROR);
+    pde_t pde = part->mm->pgdir[PDX(CHECK_PART_BASE)];
+    page_t *page = kpaddr2page(PDE_ADDR(pde));
+    ASSERT((pde & PTE_PS) && (pde & PTE_W));
+    ASSERT(page2pool(page) == part->pool && part->pool->used == NPTEENTRY);
+
+    ASSERT(partition_set_mode(part, NORMAL, NORMAL_START) == NO_ERROR);
+    ASSERT(part->mm->snap->nr_copies == NPTEENTRY);
+    ASSERT(part->mm->snap->nr_pages == 0);
+
+    // no fault, no dirty entry, the warm start copies the span back
+    int *t = (int*)CHECK_PART_BASE;
+    t[0] = -1;
+    t[last] = -2;
+    ASSERT(part->mm->snap->nr_dirty == 0);
+
+    ASSERT(partition_set_mode(part, WARM_START,
+                                    PARTITION_RESTART) == NO_ERROR);
+    ASSERT(t[0] == 100 && t[last] == 0);
+    pde = part->mm->pgdir[PDX(CHECK_PART_BASE)];
+    ASSERT((pde & PTE_PS) && kpaddr2page(PDE_ADDR(pde)) == page);
+
+    ASSERT(partition_set_mode(part, IDLE, NORMAL_START) == NO_ERROR);
+    ASSERT(part->pool->used == 0);
+    partition_destroy(part);
+}
+
+static void check_partition(void) {
+    partition_t *part = partition_create(0, 64, 0, 0, check_part_init);
+    ASSERT(part && partition_get(0) == part && part->mode == IDLE);
+
+    ASSERT(partition_set_mode(part, NORMAL, NORMAL_START) == INVALID_MODE);
+    ASSERT(partition_set_mode(part, COLD_START, NORMAL_START) == NO_ERROR);
+    ASSERT(check_part_inits == 1 && part->pool->used == CHECK_PART_INIT);
+    ASSERT(partition_set_mode(part, WARM_START,
+                                    PARTITION_RESTART) == INVALID_MODE);
+
+    ASSERT(partition_set_mode(part, NORMAL, NORMAL_START) == NO_ERROR);
+    ASSERT(partition_set_mode(part, NORMAL, NORMAL_START) == NO_ACTION);
+    ASSERT(part->mm->snap && part->mm->snap->nr_pages == CHECK_PART_INIT);
+    // the dirty log has a slot per page of the vma, faults never grow it
+    ASSERT(part->mm->snap->dirty_cap == CHECK_PART_PAGES);
+
+    // two writes copy, a new page is mapped, the rest stay shared
+    int *t = (int*)CHECK_PART_BASE;
+    t[2 * PAGE_SIZE / sizeof(int)] = -2;
+    t[5 * PAGE_SIZE / sizeof(int)] = -5;
+    t[9 * PAGE_SIZE / sizeof(int)] = -9;
+    ASSERT(t[3 * PAGE_SIZE / sizeof(int)] == 103);
+    ASSERT(part->mm->snap->nr_dirty == 3);
+    ASSERT(part->pool->used == CHECK_PART_INIT + 3);
+
+    ASSERT(partition_set_mode(part, WARM_START,
+                                    PARTITION_RESTART) == NO_ERROR);
+    ASSERT(part->last_dirty == 3 && part->nr_warm == 1);
+    ASSERT(check_part_inits == 1 && part->pool->used == CHECK_PART_INIT);
+    ASSERT(part->mm->snap->nr_dirty == 0);
+    ASSERT(get_pte(part->mm->pgdir,
+            CHECK_PART_BASE + 9 * PAGE_SIZE, 0) != NULL);
+    ASSERT(!(*get_pte(part->mm->pgdir,
+            CHECK_PART_BASE + 9 * PAGE_SIZE, 0) & PTE_P));
+    for (int i=0; i<CHECK_PART_INIT; ++i)
+        ASSERT(t[i * PAGE_SIZE / sizeof(int)] == 100 + i);
+
+    // the image survives a warm start, a second one still works
+    ASSERT(partition_set_mode(part, NORMAL, NORMAL_START) == NO_ERROR);
+    t[0] = 0;
+    ASSERT(partition_set_mode(part, WARM_START,
+                                    PARTITION_RESTART) == NO_ERROR);
+    ASSERT(t[0] == 100 && part->last_dirty == 1);
+
+    // cold start builds everything again
+    ASSERT(partition_set_mode(part, COLD_START,
+                                    HM_PARTITION_RESTART) == NO_ERROR);
+    ASSERT(check_part_inits == 2 && part->nr_cold == 2);
+    ASSERT(part->mm->snap == NULL && part->pool->used == CHECK_PART_INIT);
+
+    ASSERT(partition_set_mode(part, IDLE, NORMAL_START) == NO_ERROR);
+    ASSERT(part->mm == NULL && part->pool->used == 0);
+
+    partition_destroy(part);
+    ASSERT(partition_get(0) == NULL && current_thread->mm == NULL);
+
+    check_partition_prefault();
+    check_partition_huge();
+
+    cprintf("check partition pass.\n");
+}
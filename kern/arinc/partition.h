@@ -0,0 +1,66 @@
+#ifndef __L_PARTITION_H
+#define __L_PARTITION_H
+
+#include <types.h>
+#include <apex.h>
+#include <vmm.h>
+#include <ppool.h>
+
+/*
+分区: 自己的物理内存池和地址空间, 按 ARINC 653 的工作模式管理
+COLD_START 重建地址空间, 重新执行初始化; 初始化完成切到 NORMAL 时拍下
+初始镜像, 之后 WARM_START 只把写过的页换回镜像, 不再重新初始化
+*/
+
+#define MAX_NUMBER_OF_PARTITIONS SYSTEM_LIMIT_NUMBER_OF_PARTITIONS
+
+typedef enum {
+    IDLE = 0,
+    COLD_START = 1,
+    WARM_START = 2,
+    NORMAL = 3
+} operating_mode_type;
+
+typedef enum {
+    NORMAL_START = 0,
+    PARTITION_RESTART = 1,
+    HM_MODULE_RESTART = 2,
+    HM_PARTITION_RESTART = 3
+} start_condition_type;
+
+typedef operating_mode_type     operating_mode_t;
+
+typedef start_condition_type    start_condition_t;
+
+struct partition;
+
+// build the vmas of the partition and fill its initial data
+typedef int (*partition_init_t)(struct partition *part);
+
+typedef struct partition {
+    int                 id;         // -1 if the slot is free
+    operating_mode_t    mode;
+    start_condition_t   start_cond;
+    ppool_t             *pool;
+    vmm_t               *mm;
+    partition_init_t    init;
+    uint32_t            nr_cold;
+    uint32_t            nr_warm;
+    uint32_t            last_dirty; // pages put back by the last warm start
+} partition_t;
+
+void partition_init(void);
+
+// colors 0 for a plain pool, else the cache colors the partition owns
+partition_t *partition_create(int id, size_t pages, size_t quota,
+                                uint32_t colors, partition_init_t init);
+
+void partition_destroy(partition_t *part);
+
+partition_t *partition_get(int id);
+
+// SET_PARTITION_MODE
+return_code_t partition_set_mode(partition_t *part, operating_mode_t mode,
+                                                    start_condition_t cond);
+
+#endif
@@ -6,6 +6,8 @@
 #include <mmu.h>
 #include <error.h>
 #include <x86.h>
+#include <slab.h>
+#include <intr.h>
 
 static list_t   all_proc_set;
 
@@ -13,6 +15,9 @@ task_t *init_proc;
 
 static bitmap_t   pid_map;
 
+// task_t sits at the bottom of its kernel stack
+static kmem_cache_t *task_cache;
+
 void kernel_thread_entry_asm(void) {
     // call func(args), call do_exit
     asm volatile("pushl %%edx\n\t"
@@ -63,7 +68,7 @@ inline static void free_pid(pid_t pid) {
 
 static task_t *alloc_proc(void) {
     task_t *task;
-    if ((task = kmalloc(KSTACKSIZE)) == NULL) {
+    if ((task = kmem_cache_alloc(task_cache)) == NULL) {
         return task;
     }
 
@@ -126,7 +131,7 @@ static int kernel_thread(int (*func)(void*), void *arg) {
     goto ret;
 
 alloc_pid_fail:
-    kfree(task);
+    kmem_cache_free(task_cache, task);
 
 ret:
     return eflag;
@@ -174,21 +179,43 @@ void proc_run(task_t *task) {
 }
 
 
+// init_proc is queued like any task, it is the idle task
 void schedule(void) {
     task_t *cur = current_thread;
-    if (cur != init_proc)
-        list_push_back(&all_proc_set, &cur->all_tag);
+    list_push_back(&all_proc_set, &cur->all_tag);
     list_elem_t *nelem = list_pop_front(&all_proc_set);
     task_t *next = le2task(nelem);
+    if (next == cur)
+        return;
 
     load_esp0(next->kstack);
-    lcr3(boot_cr3);
+    mm_switch(next->mm);
     switch_to(&cur->ctxt, &next->ctxt);
 }
 
+// init_proc ends here, deferred work runs once per turn
+void cpu_idle(void) {
+    while (1) {
+        intr_disable();
+        slab_reclaim();
+        intr_enable();
+
+        // clears pages with irq on, takes the lists with irq off
+        zero_pool_refill();
+
+        intr_disable();
+        schedule();
+        intr_enable();
+    }
+}
+
 void process_init(void) {
     list_init(&all_proc_set);
 
+    task_cache = kmem_cache_create("task", KSTACKSIZE, KSTACKSIZE, NULL);
+    if (!task_cache)
+        panic("task cache create failed.\n");
+
     // pid bitmap init
     check_bitmap();
     pid_map_init();    
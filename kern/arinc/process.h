@@ -93,5 +93,7 @@ void process_init(void);
 
 void schedule(void);
 
+void cpu_idle(void) __attribute__((noreturn));
+
 
 #endif
\ No newline at end of file
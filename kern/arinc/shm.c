@@ -0,0 +1,255 @@
+#include <shm.h>
+#include <pmm.h>
+#include <vmm.h>
+#include <ppool.h>
+#include <mmu.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <error.h>
+
+
+static shm_t shms[SHM_MAX];
+
+static ppool_t *shm_pool;
+
+static void check_shm(void);
+
+/*
+ * 共享区配置表: 每项是区域号, 属主分区, 页数, 以及各分区挂接的地址.
+ * 专用池按表里的总页数建, 着色时用 SHM_POOL_COLORS 的颜色
+ */
+#define SHM_POOL_COLORS     0
+
+static const shm_config_t shm_config[] = {
+    { .id = -1 },
+};
+
+void shm_init(void) {
+    for (int i=0; i<SHM_MAX; ++i)
+        shms[i].id = -1;
+
+    check_shm();
+
+    if (shm_setup(shm_config, SHM_POOL_COLORS) != 0)
+        panic("shm config setup failed.\n");
+}
+
+int shm_pool_create(size_t pages, uint32_t colors) {
+    if (shm_pool)
+        return E_INVAL;
+
+    if (colors)
+        shm_pool = ppool_create_colored(PPOOL_SHM, pages, 0, colors);
+    else
+        shm_pool = ppool_create(PPOOL_SHM, pages, 0);
+    if (shm_pool == NULL)
+        return E_NO_MEM;
+    return 0;
+}
+
+static void shm_free_pages(shm_t *shm, size_t n) {
+    for (size_t i=0; i<n; ++i) {
+        shm->pages[i]->ref_count = 0;
+        ppool_free_pages(shm_pool, shm->pages[i], 1);
+    }
+    kfree(shm->pages);
+    shm->pages = NULL;
+}
+
+// every region must be gone
+void shm_pool_destroy(void) {
+    ASSERT(shm_pool);
+    ppool_destroy(shm_pool);
+    shm_pool = NULL;
+}
+
+shm_t *shm_create(int id, int owner, size_t pages) {
+    if (id < 0 || id >= SHM_MAX || pages == 0 || shm_pool == NULL)
+        return NULL;
+    if (owner < 0 || owner >= MAX_NUMBER_OF_PARTITIONS)
+        return NULL;
+
+    shm_t *shm = shms + id;
+    if (shm->id >= 0) {
+        warn("shm %d exist.\n", id);
+        return NULL;
+    }
+
+    if ((shm->pages = kmalloc(pages * sizeof(page_t*))) == NULL)
+        return NULL;
+
+    // the region holds every page, unmapping never frees one alone
+    for (size_t i=0; i<pages; ++i) {
+        if ((shm->pages[i] = ppool_alloc_pages(shm_pool, 1)) == NULL) {
+            shm_free_pages(shm, i);
+            return NULL;
+        }
+        page_clear(shm->pages[i]);
+        shm->pages[i]->ref_count = 1;
+    }
+
+    shm->id = id;
+    shm->owner = owner;
+    shm->npages = pages;
+    shm->cfg = NULL;
+    return shm;
+}
+
+int shm_destroy(shm_t *shm) {
+    ASSERT(shm && shm->id >= 0);
+
+    for (size_t i=0; i<shm->npages; ++i) {
+        if (shm->pages[i]->ref_count != 1)
+            return E_INVAL;
+    }
+
+    shm_free_pages(shm, shm->npages);
+    shm->id = -1;
+    return 0;
+}
+
+// every region and the pool, none may be mapped
+static void shm_release(void) {
+    for (int i=0; i<SHM_MAX; ++i) {
+        if (shms[i].id >= 0)
+            ASSERT(shm_destroy(shms + i) == 0);
+    }
+    if (shm_pool)
+        shm_pool_destroy();
+}
+
+int shm_setup(const shm_config_t *cfg, uint32_t colors) {
+    const shm_config_t *c;
+    size_t pages = 0;
+    int ret;
+
+    for (c = cfg; c->id >= 0; ++c)
+        pages += c->pages;
+    if (pages == 0)
+        return 0;
+
+    if ((ret = shm_pool_create(pages, colors)) != 0)
+        return ret;
+
+    for (c = cfg; c->id >= 0; ++c) {
+        shm_t *shm = shm_create(c->id, c->owner, c->pages);
+        if (shm == NULL) {
+            shm_release();
+            return E_NO_MEM;
+        }
+        shm->cfg = c;
+    }
+    return 0;
+}
+
+shm_t *shm_get(int id) {
+    if (id < 0 || id >= SHM_MAX || shms[id].id < 0)
+        return NULL;
+    return shms + id;
+}
+
+int shm_attach(shm_t *shm, partition_t *part, uintptr_t va) {
+    ASSERT(shm && shm->id >= 0);
+
+    if (part == NULL || part->id < 0 || part->mm == NULL)
+        return E_INVAL;
+
+    uint32_t flags = part->id == shm->owner ? VM_WRITE : 0;
+    return mm_map_shared(part->mm, va, shm->pages, shm->npages, flags);
+}
+
+int shm_attach_partition(partition_t *part) {
+    ASSERT(part && part->id >= 0);
+    int ret;
+
+    for (int i=0; i<SHM_MAX; ++i) {
+        shm_t *shm = shms + i;
+        if (shm->id < 0 || shm->cfg == NULL || shm->cfg->va[part->id] == 0)
+            continue;
+        if ((ret = shm_attach(shm, part, shm->cfg->va[part->id])) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+/*
+shm test area
+*/
+
+#define CHECK_SHM_VA    (5 * PTSIZE)
+#define CHECK_SHM_PAGES 4
+
+// region 0 written by partition 1, read by 2 at another va
+static const shm_config_t check_shm_config[] = {
+    { .id = 0, .owner = 1, .pages = CHECK_SHM_PAGES,
+      .va = { [1] = CHECK_SHM_VA, [2] = CHECK_SHM_VA + PTSIZE } },
+    { .id = -1 },
+};
+
+// the region is attached before init runs
+static int check_shm_writer(partition_t *part) {
+    for (int i=0; i<CHECK_SHM_PAGES; ++i)
+        *(uint32_t*)(CHECK_SHM_VA + i * PAGE_SIZE) = 0x5000 + i;
+    return 0;
+}
+
+static int check_shm_reader(partition_t *part) {
+    return 0;
+}
+
+static void check_shm(void) {
+    // each partition and the regions a color of their own, if there are
+    bool colored = cache_colors >= 4;
+    ASSERT(shm_setup(check_shm_config, colored ? 0x4 : 0) == 0);
+    shm_t *shm = shm_get(0);
+    ASSERT(shm && shm->cfg == check_shm_config && shm->owner == 1);
+    ASSERT(shm_create(0, 1, 1) == NULL);
+    if (colored)
+        ASSERT(page2color(shm->pages[0]) == 2);
+
+    partition_t *writer = partition_create(1, 16, 0, colored ? 0x1 : 0,
+                                                        check_shm_writer);
+    partition_t *reader = partition_create(2, 16, 0, colored ? 0x2 : 0,
+                                                        check_shm_reader);
+    ASSERT(writer && reader);
+
+    ASSERT(partition_set_mode(writer, COLD_START, NORMAL_START) == NO_ERROR);
+    ASSERT(partition_set_mode(reader, COLD_START, NORMAL_START) == NO_ERROR);
+
+    // the reader sees the writer's data through its own page dir
+    uintptr_t rva = CHECK_SHM_VA + PTSIZE;
+    for (int i=0; i<CHECK_SHM_PAGES; ++i)
+        ASSERT(*(uint32_t*)(rva + i * PAGE_SIZE) == 0x5000 + i);
+
+    pte_t *ptep = get_pte(reader->mm->pgdir, rva, 0);
+    ASSERT(ptep && (*ptep & PTE_U) && !(*ptep & PTE_W));
+    ptep = get_pte(writer->mm->pgdir, CHECK_SHM_VA, 0);
+    ASSERT(ptep && (*ptep & PTE_W));
+    ASSERT(reader->mm->pgdir[PDX(CHECK_SHM_VA)] == 0);
+    ASSERT(boot_pgdir[PDX(CHECK_SHM_VA)] == 0 && boot_pgdir[PDX(rva)] == 0);
+
+    // a write by the reader is refused, no private copy is made
+    ASSERT(do_pgfault(reader->mm, 3, rva) != 0);
+    ASSERT(shm->pages[0]->ref_count == 3 && reader->pool->used == 0);
+
+    // the snapshot leaves the shared pages writable and shared
+    ASSERT(partition_set_mode(writer, NORMAL, NORMAL_START) == NO_ERROR);
+    ASSERT(writer->mm->snap->nr_pages == 0);
+    ptep = get_pte(writer->mm->pgdir, CHECK_SHM_VA, 0);
+    ASSERT(*ptep & PTE_W);
+
+    // mapped regions stay, the spaces going away unmap them
+    ASSERT(shm_destroy(shm) == E_INVAL);
+    ASSERT(partition_set_mode(reader, IDLE, NORMAL_START) == NO_ERROR);
+    ASSERT(partition_set_mode(writer, IDLE, NORMAL_START) == NO_ERROR);
+    ASSERT(shm->pages[0]->ref_count == 1);
+
+    partition_destroy(writer);
+    partition_destroy(reader);
+    ASSERT(shm_destroy(shm) == 0 && shm_get(0) == NULL);
+    shm_pool_destroy();
+
+    cprintf("check shm pass.\n");
+}
@@ -0,0 +1,60 @@
+#ifndef __L_SHM_H
+#define __L_SHM_H
+
+#include <types.h>
+#include <pmm.h>
+#include <partition.h>
+
+/*
+分区间共享内存区: 配置阶段从专用池 PPOOL_SHM 逐页取物理页,
+映射进各参与分区自己的页目录, 属主分区读写, 其余分区只读,
+分区里对应一个 VM_SHARED vma, 挂接时一次映射完, 不走缺页
+区域本身持有每页一个引用, 分区地址空间销毁只去掉映射.
+分区用着色池时专用池也要着色, 共享区只占自己的颜色
+区域来自配置表: shm_init 按表建池建区, 分区冷启动时在执行初始化之前
+挂接表里给了它地址的每个区域
+*/
+
+#define SHM_MAX     16
+
+// a region of the configuration table, the table ends with id -1
+typedef struct shm_config {
+    int         id;
+    int         owner;
+    size_t      pages;
+    uintptr_t   va[MAX_NUMBER_OF_PARTITIONS];   // 0 if not mapped there
+} shm_config_t;
+
+typedef struct shm {
+    int         id;         // -1 if the slot is free
+    int         owner;      // partition mapping it writable
+    page_t      **pages;    // one by one, a colored pool is not contiguous
+    size_t      npages;
+    const shm_config_t  *cfg;   // NULL if not from the table
+} shm_t;
+
+void shm_init(void);
+
+// the regions of the table and a pool that just holds them, colors 0
+// for a plain pool
+int shm_setup(const shm_config_t *cfg, uint32_t colors);
+
+// the dedicated pool every region is cut from, colors 0 for a plain one
+int shm_pool_create(size_t pages, uint32_t colors);
+
+void shm_pool_destroy(void);
+
+shm_t *shm_create(int id, int owner, size_t pages);
+
+// fails while a partition still maps the region
+int shm_destroy(shm_t *shm);
+
+shm_t *shm_get(int id);
+
+// map the whole region at va in the space of part
+int shm_attach(shm_t *shm, partition_t *part, uintptr_t va);
+
+// map every table region part has a va for, at its cold start
+int shm_attach_partition(partition_t *part);
+
+#endif
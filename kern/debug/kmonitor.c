@@ -3,6 +3,10 @@
 #include <trap.h>
 #include <kmonitor.h>
 #include <kdebug.h>
+#include <pmm.h>
+#include <buddy.h>
+#include <slab.h>
+#include <ppool.h>
 
 /* *
  * Simple command-line kernel monitor useful for controlling the
@@ -20,6 +24,8 @@ static struct command commands[] = {
     {"help", "Display this list of commands.", mon_help},
     {"kerninfo", "Display information about the kernel.", mon_kerninfo},
     {"backtrace", "Print backtrace of stack frame.", mon_backtrace},
+    {"slabinfo", "Display slab caches.", mon_slabinfo},
+    {"buddyinfo", "Display free blocks of zones and pools.", mon_buddyinfo},
 };
 
 #define NCOMMANDS (sizeof(commands)/sizeof(struct command))
@@ -126,3 +132,68 @@ mon_backtrace(int argc, char **argv, struct trapframe *tf) {
     return 0;
 }
 
+/* mon_slabinfo - one line per slab cache */
+int
+mon_slabinfo(int argc, char **argv, struct trapframe *tf) {
+    slab_stat_t st;
+    cprintf("%-14s %5s %4s %3s %5s %5s %5s %7s %8s %4s\n", "name", "size", 
+        "objs", "pgs", "full", "part", "empty", "inuse", "alloc", "fail");
+
+    for (int i=0; slab_stat(i, &st) == 0; ++i) {
+        cprintf("%-14s %5d %4d %3d %5d %5d %5d %7d %8d %4d\n", st.name, 
+            st.obj_size, st.slab_objs, st.slab_pages, st.nr_full, 
+            st.nr_partial, st.nr_empty, st.inuse, st.nr_alloc, st.nr_fail);
+    }
+    return 0;
+}
+
+static void
+print_buddy_stat(const char *name, int id, buddy_stat_t *st) {
+    int order;
+    cprintf("%s %d: free %d/%d pages, largest %d, alloc %d, fail %d\n", 
+        name, id, st->free_pages, st->size, st->largest, st->nr_alloc, 
+        st->nr_fail);
+
+    // up to the top order of this buddy
+    int top = 0;
+    for (; (1 << top) < st->size; ++top);
+
+    cprintf("  order:");
+    for (order = 0; order <= top; ++order)
+        cprintf(" %5d", order);
+    cprintf("\n  free: ");
+    for (order = 0; order <= top; ++order)
+        cprintf(" %5d", st->nr_free[order]);
+    cprintf("\n  frag%%:");
+    for (order = 0; order <= top; ++order) {
+        uint32_t frag = buddy_frag_index(st, order);
+        cprintf(" %2d.%d%%", frag / 10, frag % 10);
+    }
+    cprintf("\n");
+}
+
+/* mon_buddyinfo - free blocks per order and fragmentation index */
+int
+mon_buddyinfo(int argc, char **argv, struct trapframe *tf) {
+    buddy_stat_t st;
+    ppool_t *pool;
+
+    for (int i=0; i<NR_ZONES; ++i) {
+        if (zone_stat(i, &st) == 0)
+            print_buddy_stat("zone", i, &st);
+    }
+
+    for (int i=0; i<PPOOL_MAX; ++i) {
+        if ((pool = ppool_get(i)) == NULL)
+            continue;
+        if (pool->colors) {
+            // single pages, no buddy behind the pool
+            cprintf("pool %d: colors %08x, used %d/%d pages\n", i,
+                                pool->colors, pool->used, pool->npages);
+            continue;
+        }
+        buddy_stat(&pool->bd, &st);
+        print_buddy_stat("pool", i, &st);
+    }
+    return 0;
+}
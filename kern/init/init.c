@@ -11,6 +11,8 @@
 #include <kmonitor.h>
 #include <vmm.h>
 #include <process.h>
+#include <partition.h>
+#include <shm.h>
 
 
 void kern_init(void) __attribute__((noreturn));
@@ -29,12 +31,15 @@ kern_init(void){
 
 
     pmm_init();                 // init physical memory management
-    vmm_init();
-    process_init();
 
     pic_init();                 // init interrupt controller
     idt_init();                 // init interrupt descriptor table
 
+    vmm_init();                 // init virtual memory management, needs pgfault
+    process_init();
+    partition_init();           // partition table, needs vmm
+    shm_init();                 // shared regions between partitions
+
     clock_init();               // init clock interrupt
     intr_enable();              // enable irq interrupt
 
@@ -42,8 +47,6 @@ kern_init(void){
     // user/kernel mode switch test
     //lab1_switch_test();
 
-    /* do nothing */
-    schedule();
-    while (1);
+    cpu_idle();
 }
 
@@ -3,6 +3,7 @@
 #include <buddy.h>
 #include <assert.h>
 #include <pmm.h>
+#include <x86.h>
 
 #define DEBUG 0 
 
@@ -12,39 +13,47 @@
     #define dprintf(f_, ...)
 #endif
 
-#define buddy_parent(index) (((index) - 1) / 2)
-#define buddy_left(index)   ((index) * 2 + 1)
-#define buddy_right(index)  ((index) * 2 + 2)
-#define buddy_elem(bd_ptr, index)   ((buddy_elem_t*)(bd_ptr)->buff + index)
-
-
 void dprintf_buff(buddy_t *bd) {
-    int total_elem = bd->size * 2 - 1;
-    buddy_elem_t *cur_elem;
-    for (int i=0; i<total_elem; ++i) {
-        cur_elem = buddy_elem(bd, i);
-        dprintf("%d ", cur_elem->elem_size);
+    for (int mt=0; mt<MIGRATE_TYPES; ++mt) {
+        for (int i=0; i<=bd->level; ++i) {
+            dprintf("%d ", bd->free_area[mt][i].len);
+        }
+        dprintf("\n");
     }
-    dprintf("\n");
 }
 
-// return binary tree level for the given index, start from 0
-static int index2level(int index) {
-    ++index;
-    int cur = 0;
-    while (index) {
-        index >>= 1;
-        ++cur;
-    }
-    return cur - 1;
+// return order of the smallest block holding pages, pages > 0
+inline static int pages2order(uint32_t pages) {
+    return pages == 1 ? 0 : bsr(pages - 1) + 1;
 }
 
-// return reverse level by input level_size, start form 0
-static int size2level(int size) {
-    int res = 0;
-    for (; size; ++res)
-        size >>= 1;
-    return res - 1;
+inline static int node_mtype(buddy_t *bd, buddy_node_t *node) {
+    return buddy_pageblock(bd, node - (buddy_node_t*)bd->buff)->mtype;
+}
+
+// free block goes to the list of its first pageblock type
+inline static void push_free_node(buddy_t *bd, buddy_node_t *node, int order) {
+    int mt = node_mtype(bd, node);
+    node->order = order;
+    node->free = 1;
+    list_push_front(&bd->free_area[mt][order], &node->tag);
+    SET_BIT(order, bd->free_mask[mt]);
+}
+
+inline static void erase_free_node(buddy_t *bd, buddy_node_t *node) {
+    int order = node->order;
+    int mt = node_mtype(bd, node);
+    node->free = 0;
+    list_erase(&bd->free_area[mt][order], &node->tag);
+    if (list_empty(&bd->free_area[mt][order]))
+        CLEAR_BIT(order, bd->free_mask[mt]);
+}
+
+// set type of the pageblocks in a block of order
+static void set_pageblock_type(buddy_t *bd, uint32_t index, int order, int mt) {
+    uint32_t n = order > PAGEBLOCK_ORDER ? 1 << (order - PAGEBLOCK_ORDER) : 1;
+    for (uint32_t i=0; i<n; ++i)
+        buddy_pageblock(bd, index + (i << PAGEBLOCK_ORDER))->mtype = mt;
 }
 
 static void buddy_check(buddy_t *bd);
@@ -52,169 +61,310 @@ static void buddy_check(buddy_t *bd);
 void buddy_init(buddy_t *bd, uint32_t size, uintptr_t bd_buff) {
     // assert size is pow of 2
     ASSERT(is_pow_of_2(size));
-    
-    int total_elem = size * 2 - 1;
-
-    // for phy mem pool, should be specific addr
-    // int pages = total_len / PAGE_SIZE;   
-    void *addr_st = NULL;
-    // addr_st = malloc(total_elem * sizeof(buddy_elem_t));
-    addr_st = (void*)bd_buff;
-    // void *addr_ed = (uint8_t*)addr_st + pages * PAGE_SIZE;
-    
-    // init binary tree
-    bd->buff = addr_st;
+
+    bd->buff = (void*)bd_buff;
     bd->size = size;
-    bd->level = size2level(size);
-
-    int level_size = size, level_len = 1;
-    int cur_level_index = 0;
-    buddy_elem_t *cur_elem = NULL;
-    for (int i=0; i<total_elem; ++i) {
-        cur_elem = buddy_elem(bd, i);
-        cur_elem->elem_size = level_size;
-        ++cur_level_index;
-        if (cur_level_index == level_len) {
-            cur_level_index = 0;
-            level_len <<= 1;
-            level_size >>= 1;
-        }
+    bd->level = bsr(size);
+    bd->free_pages = size;
+    bd->nr_alloc = bd->nr_fail = 0;
+    ASSERT(bd->level < BUDDY_MAX_ORDER);
+
+    for (int mt=0; mt<MIGRATE_TYPES; ++mt) {
+        bd->free_mask[mt] = 0;
+        for (int i=0; i<BUDDY_MAX_ORDER; ++i)
+            list_init(&bd->free_area[mt][i]);
     }
 
+    // every pageblock starts unmovable
+    memset(bd->buff, 0, buddy_buff_size(size));
+
+    // one free block of the top order
+    push_free_node(bd, buddy_node(bd, 0), bd->level);
+
     buddy_check(bd);
 }
 
 
-static void fix_parent_buddy_size(buddy_t *bd, int index) {
-    if (index == 0)
-        return;
-
-    int parent = buddy_parent(index);
-    buddy_elem_t *left, *right, *elem;
-
-    while (parent >= 0) {
-        elem = buddy_elem(bd, parent);
-        left = buddy_elem(bd, buddy_left(parent));
-        right = buddy_elem(bd, buddy_right(parent));
-        
-        if (left->elem_size != right->elem_size)
-            elem->elem_size = left->elem_size > right->elem_size ? 
-                                        left->elem_size : right->elem_size;
-        else
-            elem->elem_size = left->elem_size << 1;
-        
-        if (parent == 0)
-            break;
-        parent = buddy_parent(parent);
+// split node of order cur down to order, upper halves go back free
+inline static void split_node(buddy_t *bd, buddy_node_t *node, int cur, int order) {
+    uint32_t index = node - (buddy_node_t*)bd->buff;
+    while (cur > order) {
+        --cur;
+        push_free_node(bd, buddy_node(bd, index + (1 << cur)), cur);
     }
+    node->order = order;
 }
 
-// private func to find proper buddy slot in a sub tree
-static int find_buddy_slot(buddy_t *bd, int pages) {
-    buddy_elem_t *elem, *left_elem, *right_elem;
-    int index = 0;
-    const int level = bd->level - size2level(pages);
-    int clevel = 0;
-
-    for (;;) {
-        elem = buddy_elem(bd, index);
-        if (elem->elem_size == pages && clevel == level) {
-            elem->elem_size = 0;
-            fix_parent_buddy_size(bd, index);
-            return index;
-        }
-
-        if (elem->elem_size >= pages) {
-            ++clevel;
-            left_elem = buddy_elem(bd, buddy_left(index));
-            if (left_elem->elem_size >= pages) {
-                index = buddy_left(index);
-                continue;
-            }
-
-            right_elem = buddy_elem(bd, buddy_right(index));
-            if (right_elem->elem_size >= pages) {
-                index = buddy_right(index);
-                continue;
-            }
-        }
-        else {
-            return -1;
-        }
+// no block of mt, take the largest block of another type, keep at least a
+// pageblock of it and turn that into mt
+static buddy_node_t *steal_fallback(buddy_t *bd, int order, int mt) {
+    for (int other=0; other<MIGRATE_TYPES; ++other) {
+        if (other == mt)
+            continue;
+
+        uint32_t mask = bd->free_mask[other] & ~((1 << order) - 1);
+        if (mask == 0)
+            continue;
+
+        int cur = bsr(mask);
+        buddy_node_t *node = le2bdnode(list_front(&bd->free_area[other][cur]));
+        uint32_t index = node - (buddy_node_t*)bd->buff;
+        erase_free_node(bd, node);
+
+        // smaller than a pageblock, other free blocks of the pageblock
+        // are still on the lists of its type, borrow without converting
+        if (cur < PAGEBLOCK_ORDER)
+            return node;
+
+        int keep = order > PAGEBLOCK_ORDER ? order : PAGEBLOCK_ORDER;
+        split_node(bd, node, cur, keep);
+        set_pageblock_type(bd, index, keep, mt);
+        return node;
     }
+    return NULL;
 }
 
-buddy_elem_t *buddy_alloc(buddy_t *bd, uint32_t pages) {
-    ASSERT(bd);
+buddy_node_t *buddy_alloc_mt(buddy_t *bd, uint32_t pages, int mt) {
+    ASSERT(bd && mt < MIGRATE_TYPES);
 
     if (pages == 0)
         return NULL;
-    int res_index;
 
-    pages = next_pow_of_2(pages);
-    if ((res_index = find_buddy_slot(bd, pages)) > 0) {
-        return buddy_elem(bd, res_index);
+    int order = pages2order(pages);
+    if (order > bd->level)
+        goto failed;
+
+    // smallest non empty order >= order
+    buddy_node_t *node;
+    uint32_t mask = bd->free_mask[mt] & ~((1 << order) - 1);
+    int cur;
+
+    if (mask) {
+        cur = bsf(mask);
+        node = le2bdnode(list_front(&bd->free_area[mt][cur]));
+        erase_free_node(bd, node);
     }
-    else 
-        return NULL;
+    else if ((node = steal_fallback(bd, order, mt)) != NULL) {
+        cur = node->order;
+    }
+    else
+        goto failed;
+
+    // split, the upper half goes back to the lower order
+    split_node(bd, node, cur, order);
+    bd->free_pages -= 1 << order;
+    bd->nr_alloc++;
+    return node;
+
+failed:
+    bd->nr_fail++;
+    return NULL;
+}
+
+buddy_node_t *buddy_alloc(buddy_t *bd, uint32_t pages) {
+    return buddy_alloc_mt(bd, pages, MIGRATE_UNMOVABLE);
 }
 
 
-void buddy_free(buddy_t *bd, buddy_elem_t *ptr, uint32_t pages) {
+void buddy_free(buddy_t *bd, buddy_node_t *ptr, uint32_t pages) {
     ASSERT(bd && ptr);
-    // ASSERT(is_pow_of_2(pages));
 
-    int page_align = next_pow_of_2(pages);
-    int index = 0;
+    int order = pages2order(pages);
+    uint32_t index = ptr - (buddy_node_t*)bd->buff;
+    buddy_node_t *buddy;
 
-    if (ptr->elem_size != 0) {
-        ASSERT(ptr->elem_size == page_align);
-        return;
+    ASSERT(!ptr->free);
+    ASSERT(ptr->order == order);
+    bd->free_pages += 1 << order;
+
+    // merge while the buddy is a free block of the same order
+    while (order < bd->level) {
+        buddy = buddy_node(bd, index ^ (1 << order));
+        if (!buddy->free || buddy->order != order)
+            break;
+
+        erase_free_node(bd, buddy);
+        index &= ~(1 << order);
+        ++order;
     }
 
-    ptr->elem_size = page_align;
-    index = ptr - (buddy_elem_t*)bd->buff;
-    fix_parent_buddy_size(bd, index);
-    return;
+    push_free_node(bd, buddy_node(bd, index), order);
 }
 
 
 // return page index
-int alloc_page_buddy(buddy_t *bd, uint32_t pages) {
+int alloc_page_buddy_mt(buddy_t *bd, uint32_t pages, int mt) {
     ASSERT(bd);
 
-    buddy_elem_t *elem = buddy_alloc(bd, pages);
-    if (!elem)
+    buddy_node_t *node = buddy_alloc_mt(bd, pages, mt);
+    if (!node)
         return -1;
 
-    int index = elem - (buddy_elem_t*)bd->buff;
-    int level = index2level(index);
-    int level_size = 1 << (bd->level - level);
-    int off_index = index - (1 << level) + 1;
-    uint32_t res_addr = level_size * off_index;
+    return node - (buddy_node_t*)bd->buff;
+}
+
+int alloc_page_buddy(buddy_t *bd, uint32_t pages) {
+    return alloc_page_buddy_mt(bd, pages, MIGRATE_UNMOVABLE);
+}
+
+void buddy_isolate(buddy_t *bd, uint32_t index, int order) {
+    uint32_t ed = index + (1 << order);
+    buddy_node_t *node;
+
+    ASSERT((index & ((1 << order) - 1)) == 0 && ed <= bd->size);
+
+    // blocks inside the range are free heads or used heads
+    while (index < ed) {
+        node = buddy_node(bd, index);
+        ASSERT(node->order <= order);
+        if (node->free) {
+            erase_free_node(bd, node);
+            bd->free_pages -= 1 << node->order;
+        }
+        index += 1 << node->order;
+    }
+}
+
+// take [st, ed) out of the free block of order at head, the parts
+// outside the range go back free
+static void buddy_carve(buddy_t *bd, uint32_t head, int order,
+                                                uint32_t st, uint32_t ed) {
+    uint32_t bed = head + (1 << order);
+
+    if (ed <= head || st >= bed) {
+        push_free_node(bd, buddy_node(bd, head), order);
+        return;
+    }
+    if (st <= head && bed <= ed) {
+        buddy_node(bd, head)->order = order;
+        bd->free_pages -= 1 << order;
+        return;
+    }
+
+    --order;
+    buddy_carve(bd, head, order, st, ed);
+    buddy_carve(bd, head + (1 << order), order, st, ed);
+}
 
-    return res_addr;
+void buddy_reserve(buddy_t *bd, uint32_t index, uint32_t pages) {
+    uint32_t ed = index + pages;
+    ASSERT(ed <= bd->size);
+
+    while (index < ed) {
+        // the free block holding index, from the largest one down
+        buddy_node_t *node = NULL;
+        uint32_t head = 0;
+        int order;
+
+        for (order = bd->level; order >= 0; --order) {
+            head = index & ~((1U << order) - 1);
+            node = buddy_node(bd, head);
+            if (node->free && node->order == order)
+                break;
+        }
+
+        // already taken
+        if (order < 0) {
+            ++index;
+            continue;
+        }
+
+        erase_free_node(bd, node);
+        buddy_carve(bd, head, order, index, ed);
+        index = head + (1U << order) < ed ? head + (1U << order) : ed;
+    }
+}
+
+void buddy_split(buddy_t *bd, uint32_t index, int order) {
+    buddy_node_t *node = buddy_node(bd, index);
+
+    ASSERT((index & ((1 << order) - 1)) == 0 && index < bd->size);
+    ASSERT(!node->free && node->order == order);
+
+    // nodes inside a used block are never free, only their order is stale
+    for (uint32_t i=0; i<(1U << order); ++i)
+        node[i].order = 0;
 }
 
 // page_index
 void free_page_buddy(buddy_t *bd, uint32_t page_index, uint32_t pages) {
     ASSERT(bd);
+    ASSERT(page_index < bd->size);
 
-    pages = next_pow_of_2(pages);
-    int rlevel = size2level(pages);
-
-    int off_index = page_index >> rlevel;
-    int index = (1 << (bd->level - rlevel)) - 1 + off_index;
+    buddy_free(bd, buddy_node(bd, page_index), pages);
+}
 
-    buddy_free(bd, buddy_elem(bd, index), pages);
 
+void buddy_stat(buddy_t *bd, buddy_stat_t *st) {
+    st->size = bd->size;
+    st->free_pages = bd->free_pages;
+    uint32_t mask = 0;
+    for (int mt=0; mt<MIGRATE_TYPES; ++mt)
+        mask |= bd->free_mask[mt];
+
+    st->largest = mask ? 1 << bsr(mask) : 0;
+    st->nr_alloc = bd->nr_alloc;
+    st->nr_fail = bd->nr_fail;
+    for (int i=0; i<BUDDY_MAX_ORDER; ++i) {
+        st->nr_free[i] = 0;
+        for (int mt=0; mt<MIGRATE_TYPES; ++mt)
+            st->nr_free[i] += bd->free_area[mt][i].len;
+    }
 }
 
+// (free - free in blocks >= order) / free
+uint32_t buddy_frag_index(buddy_stat_t *st, int order) {
+    uint64_t usable = 0, frag;
+    if (st->free_pages == 0)
+        return 0;
+
+    for (int i=order; i<BUDDY_MAX_ORDER; ++i)
+        usable += (uint64_t)st->nr_free[i] << i;
+    // a 64G user zone has 2^24 pages, times 1000 needs 64 bits
+    frag = (st->free_pages - usable) * 1000;
+    do_div(frag, st->free_pages);
+    return (uint32_t)frag;
+}
 
 static void buddy_check(buddy_t *bd) {
     assert(bd);
 
+    // the checks below need a block of 512 pages
+    if (bd->size < (1 << 10))
+        return;
+
     int res_index[10] = {0};
+    buddy_stat_t st;
+
+    buddy_stat(bd, &st);
+    assert(st.free_pages == bd->size && st.largest == bd->size);
+    assert(buddy_frag_index(&st, 0) == 0 && buddy_frag_index(&st, bd->level) == 0);
+
+    // pages 0 and 2 taken: 1 and 3 free as order 0, the rest in big blocks
+    res_index[0] = alloc_page_buddy(bd, 1);
+    res_index[1] = alloc_page_buddy(bd, 1);
+    res_index[2] = alloc_page_buddy(bd, 1);
+    free_page_buddy(bd, res_index[1], 1);
+    buddy_stat(bd, &st);
+    assert(st.free_pages == bd->size - 2 && st.largest == bd->size >> 1);
+    assert(st.nr_free[0] == 2 && st.nr_free[1] == 0 && st.nr_free[2] == 1);
+    assert(buddy_frag_index(&st, 1) == 2000 / (bd->size - 2));
+    free_page_buddy(bd, res_index[0], 1);
+    free_page_buddy(bd, res_index[2], 1);
+
+    // movable takes a pageblock of its own from the top, unmovable stays low
+    res_index[0] = alloc_page_buddy(bd, 1);
+    res_index[1] = alloc_page_buddy_mt(bd, 1, MIGRATE_MOVABLE);
+    res_index[2] = alloc_page_buddy(bd, 1);
+    assert(res_index[0] == 0 && res_index[2] == 1);
+    assert(res_index[1] == bd->size >> 1);
+    assert(buddy_pageblock(bd, res_index[1])->mtype == MIGRATE_MOVABLE);
+    res_index[3] = alloc_page_buddy_mt(bd, 1, MIGRATE_MOVABLE);
+    assert(res_index[3] == res_index[1] + 1);
+    for (int i=0; i<4; ++i)
+        free_page_buddy(bd, res_index[i], 1);
+    assert(bd->free_pages == bd->size);
+    buddy_pageblock(bd, bd->size >> 1)->mtype = MIGRATE_UNMOVABLE;
     
     int times = 5;
     for (int i=0; i<times; ++i) {
@@ -3,30 +3,94 @@
 
 #include <types.h>
 #include <pmm.h>
+#include <list.h>
 
 /*
-更加简化的buddy系统，使用完全二叉树对节点进行组织
+buddy系统，每个阶一条空闲链表，节点数组与页一一对应
+分配时取最小的非空阶，拆分后的另一半挂回低阶链表
+释放时按 index ^ (1 << order) 找到伙伴并逐级合并
+
+按可移动性分组: 内存按 pageblock 划分, 每个 pageblock 有一个类型,
+空闲块挂在其首个 pageblock 类型的链表上, 可移动与不可移动的分配
+各自从本类型链表取, 不够时才整块借用另一类型最大的空闲块,
+不可移动页不会散落在可移动区中, 规整时可以腾出整块
 */
 
+// orders 0 .. BUDDY_MAX_ORDER-1, enough for 64G of 4K pages
+#define BUDDY_MAX_ORDER 25
+
+#define MIGRATE_UNMOVABLE   0   // slab, page tables, kernel blocks
+#define MIGRATE_MOVABLE     1   // single mapped pages, see rmap in page_t
+#define MIGRATE_TYPES       2
+
+// 1M pageblocks
+#define PAGEBLOCK_ORDER     8
+
+typedef struct buddy_node {
+    list_elem_t tag;        // link in free_area[mt][order] while free
+    uint16_t    order;      // order of the block this node heads
+    uint8_t     free;
+    uint8_t     mtype;      // type of the pageblock, on its first node
+} buddy_node_t;
 
 typedef struct buddy {
     void *buff;
     void *st_addr;
     int size;
     int level;
+    uint32_t free_mask[MIGRATE_TYPES];  // bit n set if free_area[][n] not empty
+    list_t free_area[MIGRATE_TYPES][BUDDY_MAX_ORDER];
+    uint32_t free_pages;
+    uint32_t nr_alloc;
+    uint32_t nr_fail;
 } buddy_t;
 
-typedef struct buddy_elem {
-    int elem_size;
-} buddy_elem_t;
+// snapshot of a buddy, free blocks of order n is nr_free[n]
+typedef struct buddy_stat {
+    uint32_t size;
+    uint32_t free_pages;
+    uint32_t largest;       // pages of the largest free block
+    uint32_t nr_alloc;
+    uint32_t nr_fail;
+    uint32_t nr_free[BUDDY_MAX_ORDER];
+} buddy_stat_t;
+
+// bytes of node buffer buddy_init needs for size pages
+#define buddy_buff_size(size)   ((size) * sizeof(buddy_node_t))
+
+#define le2bdnode(le)   elem2entry(buddy_node_t, tag, le)
+
+#define buddy_node(bd_ptr, index)   ((buddy_node_t*)(bd_ptr)->buff + (index))
+
+// first node of the pageblock holding index
+#define buddy_pageblock(bd_ptr, index)  \
+            buddy_node(bd_ptr, (index) & ~((1 << PAGEBLOCK_ORDER) - 1))
 
 void dprintf_buff(buddy_t*);
 
 void buddy_init(buddy_t *, uint32_t size, uintptr_t buff_addr);
-buddy_elem_t *buddy_alloc(buddy_t *, uint32_t);
-void buddy_free(buddy_t *, buddy_elem_t*, uint32_t);
+buddy_node_t *buddy_alloc(buddy_t *, uint32_t);
+void buddy_free(buddy_t *, buddy_node_t*, uint32_t);
+
+buddy_node_t *buddy_alloc_mt(buddy_t *, uint32_t, int mtype);
 
 int alloc_page_buddy(buddy_t *, uint32_t pages);
+int alloc_page_buddy_mt(buddy_t *, uint32_t pages, int mtype);
 void free_page_buddy(buddy_t *, uint32_t pindex, uint32_t pages);
 
+// take the free blocks inside [index, index + 2^order) off the free lists,
+// the range must not be inside a larger free block
+void buddy_isolate(buddy_t *, uint32_t index, int order);
+
+// take [index, index + pages) off the free lists for good, holes and
+// the tail past the end of a zone that is not a power of 2
+void buddy_reserve(buddy_t *, uint32_t index, uint32_t pages);
+
+// a used block of order becomes 2^order used pages, each freed alone
+void buddy_split(buddy_t *, uint32_t index, int order);
+
+void buddy_stat(buddy_t *, buddy_stat_t *);
+// per mille of free pages unusable for a block of order, 0 if none free
+uint32_t buddy_frag_index(buddy_stat_t *, int order);
+
 #endif
\ No newline at end of file
@@ -30,14 +30,16 @@
  *                                                              kernel/user
  *
  *     4G ------------------> +---------------------------------+
+ *                            |       Invalid Memory (*)        | --/-- 4 * PTSIZE
+ *     KGUARD_BASE ---------> +---------------------------------+ 0xFF800000
  *                            |                                 |
  *                            |         Empty Memory (*)        |
  *                            |                                 |
- *                            +---------------------------------+ 0xFB000000
- *                            |   Cur. Page Table (Kern, RW)    | RW/-- PTSIZE
- *     VPT -----------------> +---------------------------------+ 0xFAC00000
- *                            |        Invalid Memory (*)       | --/--
- *     KERNTOP -------------> +---------------------------------+ 0xF8000000
+ *                            +---------------------------------+ 0xFAE00000
+ *                            |    kmap slots (Kern, RW)        | RW/-- PTSIZE
+ *     KMAP_BASE,VMALLOC_END> +---------------------------------+ 0xFAC00000
+ *                            |     vmalloc area (Kern, RW)     | RW/--
+ *     KERNTOP,VMALLOC_START> +---------------------------------+ 0xF8000000
  *                            |                                 |
  *                            |    Remapped Physical Memory     | RW/-- KMEMSIZE
  *                            |                                 |
@@ -52,17 +54,23 @@
  *
  * */
 
-/* All physical memory mapped at this address */
-#define KMEMSIZE            0x38000000                  // the maximum amount of physical memory
+/* Low physical memory mapped at this address, the user zone goes on above */
+#define KMEMSIZE            0x38000000                  // the maximum amount of linear mapped memory
 #define KERNTOP             (KERNBASE + KMEMSIZE)
 
-/* *
- * Virtual page table. Entry PDX[VPT] in the PD (Page Directory) contains
- * a pointer to the page directory itself, thereby turning the PD into a page
- * table, which maps all the PTEs (Page Table Entry) containing the page mappings
- * for the entire virtual address space into that 4 Meg region starting at VPT.
- * */
-#define VPT                 0xFAC00000
+/* PAE reaches 64G, memory past it is left out */
+#define PHYSMAX             0x1000000000ULL
+
+/* the top 8M is never mapped, a stray pointer just below NULL faults */
+#define KGUARD_BASE         0xFF800000
+
+/* one page table of slots for pages outside the linear map, see kmap */
+#define KMAP_BASE           0xFAC00000
+#define KMAP_END            0xFAE00000
+
+/* page-by-page mapped kernel buffers, page tables are set up at boot */
+#define VMALLOC_START       KERNTOP
+#define VMALLOC_END         KMAP_BASE
 
 #define PGSIZE      4096
 #define KSTACKPAGE          2                           // # of pages in kernel stack
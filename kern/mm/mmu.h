@@ -61,6 +61,11 @@
 
 #include <mmu.h>
 
+/* PAE page table entries are 64 bits, so are physical addresses */
+typedef uint64_t pte_t;
+typedef uint64_t pde_t;
+typedef uint64_t paddr_t;
+
 /* Gate descriptors for interrupts and traps */
 struct gatedesc {
     unsigned gd_off_15_0 : 16;      // low 16 bits of offset in segment
@@ -187,24 +192,26 @@ struct taskstate {
 
 #endif /* !__ASSEMBLER__ */
 
-// A linear address 'la' has a three-part structure as follows:
+// With PAE a linear address 'la' has a four-part structure as follows:
 //
-// +--------10------+-------10-------+---------12----------+
-// | Page Directory |   Page Table   | Offset within Page  |
-// |      Index     |     Index      |                     |
-// +----------------+----------------+---------------------+
-//  \--- PDX(la) --/ \--- PTX(la) --/ \---- PGOFF(la) ----/
-//  \----------- PPN(la) -----------/
+// +-2-+------9------+-------9------+---------12----------+
+// |Dir|    Page     |   Page Table | Offset within Page  |
+// |Ptr|  Directory  |     Index    |                     |
+// +---+-------------+--------------+---------------------+
+//  \---- PDX(la) ---/ \-- PTX(la) -/ \---- PGOFF(la) ----/
+//  \----------------- PPN(la) -----/
 //
+// The four page directories of a space are one block of four pages, so
+// PDX takes the pointer table index too and indexes all of them at once.
 // The PDX, PTX, PGOFF, and PPN macros decompose linear addresses as shown.
 // To construct a linear address la from PDX(la), PTX(la), and PGOFF(la),
 // use PGADDR(PDX(la), PTX(la), PGOFF(la)).
 
 // page directory index
-#define PDX(la) ((((uintptr_t)(la)) >> PDXSHIFT) & 0x3FF)
+#define PDX(la) ((((uintptr_t)(la)) >> PDXSHIFT) & 0x7FF)
 
 // page table index
-#define PTX(la) ((((uintptr_t)(la)) >> PTXSHIFT) & 0x3FF)
+#define PTX(la) ((((uintptr_t)(la)) >> PTXSHIFT) & 0x1FF)
 
 // page number field of address
 #define PPN(la) (((uintptr_t)(la)) >> PTXSHIFT)
@@ -215,21 +222,25 @@ struct taskstate {
 // construct linear address from indexes and offset
 #define PGADDR(d, t, o) ((uintptr_t)((d) << PDXSHIFT | (t) << PTXSHIFT | (o)))
 
-// address in page table or page directory entry
-#define PTE_ADDR(pte)   ((uintptr_t)(pte) & ~0xFFF)
+// physical address in page table or page directory entry, 36 bits and up
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+#define PTE_ADDR(pte)   ((paddr_t)(pte) & PTE_ADDR_MASK)
 #define PDE_ADDR(pde)   PTE_ADDR(pde)
+// flags of an entry, NX included
+#define PTE_FLAGS(pte)  ((pte_t)(pte) & ~PTE_ADDR_MASK)
 
 /* page directory and page table constants */
-#define NPDEENTRY       1024                    // page directory entries per page directory
-#define NPTEENTRY       1024                    // page table entries per page table
+#define NPDPTENTRY      4                       // page directories per space, entries of the pointer table
+#define NPDEENTRY       2048                    // page directory entries of the four page directories
+#define NPTEENTRY       512                     // page table entries per page table
 
 #define PGSIZE          4096                    // bytes mapped by a page
 #define PGSHIFT         12                      // log2(PGSIZE)
 #define PTSIZE          (PGSIZE * NPTEENTRY)    // bytes mapped by a page directory entry
-#define PTSHIFT         22                      // log2(PTSIZE)
+#define PTSHIFT         21                      // log2(PTSIZE)
 
 #define PTXSHIFT        12                      // offset of PTX in a linear address
-#define PDXSHIFT        22                      // offset of PDX in a linear address
+#define PDXSHIFT        21                      // offset of PDX in a linear address
 
 /* page table/directory entry flags */
 #define PTE_P           0x001                   // Present
@@ -240,10 +251,12 @@ struct taskstate {
 #define PTE_A           0x020                   // Accessed
 #define PTE_D           0x040                   // Dirty
 #define PTE_PS          0x080                   // Page Size
+#define PTE_G           0x100                   // Global
 #define PTE_MBZ         0x180                   // Bits must be zero
 #define PTE_AVAIL       0xE00                   // Available for software use
                                                 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
                                                 // hardware, so user processes are allowed to set them arbitrarily.
+#define PTE_NX          0x8000000000000000ULL   // No Execute, reserved unless EFER.NXE
 
 #define PTE_USER        (PTE_U | PTE_W | PTE_P)
 
@@ -261,6 +274,8 @@ struct taskstate {
 #define CR0_PG          0x80000000              // Paging
 
 #define CR4_PCE         0x00000100              // Performance counter enable
+#define CR4_PAE         0x00000020              // Physical Address Extension
+#define CR4_PGE         0x00000080              // Page Global Enable
 #define CR4_MCE         0x00000040              // Machine Check Enable
 #define CR4_PSE         0x00000010              // Page Size Extensions
 #define CR4_DE          0x00000008              // Debugging Extensions
@@ -268,5 +283,17 @@ struct taskstate {
 #define CR4_PVI         0x00000002              // Protected-Mode Virtual Interrupts
 #define CR4_VME         0x00000001              // V86 Mode Extensions
 
+/* CPUID.01H:EDX feature flags */
+#define CPUID_PSE       0x00000008              // 4MB pages
+#define CPUID_PAE       0x00000040              // physical address extension
+#define CPUID_PGE       0x00002000              // global pages
+
+/* CPUID.80000001H:EDX feature flags */
+#define CPUID_NX        0x00100000              // no execute pages
+
+/* Extended feature enable register */
+#define MSR_EFER        0xC0000080
+#define EFER_NXE        0x00000800              // PTE_NX takes effect
+
 #endif /* !__KERN_MM_MMU_H__ */
 
@@ -9,6 +9,10 @@
 #include <error.h>
 #include <slab.h>
 #include <string.h>
+#include <ppool.h>
+#include <vmalloc.h>
+#include <tlsf.h>
+#include <intr.h>
 
 /* *
  * Task State Segment:
@@ -33,11 +37,14 @@
 static struct taskstate ts = {0};
 
 // virtual address of boot-time page directory
-extern uintptr_t __boot_pgdir;
-uintptr_t *boot_pgdir = &__boot_pgdir;
-// physical address of boot-time page directory
+extern pde_t __boot_pgdir[];
+extern pde_t __boot_pdpt[];
+pde_t *boot_pgdir = __boot_pgdir;
+// physical address of boot-time page dir pointer table
 uintptr_t boot_cr3;
 
+pte_t pte_nx;
+
 
 /* *
  * Global Descriptor Table:
@@ -110,10 +117,48 @@ gdt_init(void) {
 }
 
 
-// get memory layout, return max_memory area
-static uintptr_t get_mem_layout(void) {
+// usable ranges of physical memory, page aligned, sorted, not touching
+typedef struct mem_region {
+    paddr_t st;
+    paddr_t ed;
+} mem_region_t;
+
+static mem_region_t mem_regions[E820MAX];
+static int nr_mem_regions;
+
+// add [st, ed) to the sorted region table, merge what it touches
+static void mem_region_add(paddr_t st, paddr_t ed) {
+    int i = 0, j;
+    while (i < nr_mem_regions && mem_regions[i].ed < st)
+        ++i;
+
+    // regions from i to j - 1 overlap or touch it
+    for (j = i; j < nr_mem_regions && mem_regions[j].st <= ed; ++j) {
+        if (mem_regions[j].st < st)
+            st = mem_regions[j].st;
+        if (mem_regions[j].ed > ed)
+            ed = mem_regions[j].ed;
+    }
+
+    int n = nr_mem_regions - j;
+    if (j == i) {
+        memmove(mem_regions + i + 1, mem_regions + i, n * sizeof(mem_region_t));
+        nr_mem_regions++;
+    }
+    else {
+        memmove(mem_regions + i + 1, mem_regions + j, n * sizeof(mem_region_t));
+        nr_mem_regions -= j - i - 1;
+    }
+    mem_regions[i].st = st;
+    mem_regions[i].ed = ed;
+}
+
+// get memory layout, keep every usable region below PHYSMAX,
+// return the end of the last one
+static paddr_t get_mem_layout(void) {
     e820map_t *mmap = (e820map_t*)(E820MAP_ADDR);
-    uintptr_t mem_end = 0;
+    uint64_t lost = 0;
+
     for (int i=0; i<mmap->nr_map; ++i) {
         uint64_t begin, end;
         begin = mmap->map[i].addr;
@@ -121,69 +166,471 @@ static uintptr_t get_mem_layout(void) {
         cprintf("  memory: %08llx, [%08llx, %08llx], type = %d.\n",
                 mmap->map[i].size, begin, end - 1, mmap->map[i].type);
 
-        if (mmap->map[i].type == E820_ARM) {
-            if (end > mem_end && begin < KMAXSIZE) {
-                mem_end = end;
-            }
+        if (mmap->map[i].type != E820_ARM)
+            continue;
+
+        // PAE addresses stop at PHYSMAX, memory past it is left out
+        begin = ROUNDUP(begin, PAGE_SIZE);
+        end = ROUNDDOWN(end, PAGE_SIZE);
+        if (end > PHYSMAX) {
+            lost += end - (begin > PHYSMAX ? begin : PHYSMAX);
+            end = PHYSMAX;
         }
+        if (begin < end)
+            mem_region_add(begin, end);
     }
 
+    for (int i=0; i<nr_mem_regions; ++i)
+        cprintf("  usable: [%08llx, %08llx)\n", mem_regions[i].st,
+                                                    mem_regions[i].ed);
+    if (lost)
+        cprintf("  unused above PHYSMAX: %lldM\n", lost >> 20);
+
     extern char end[];
     cprintf("end addr: %x\n", end);
-    return mem_end;
+    return nr_mem_regions ? mem_regions[nr_mem_regions - 1].ed : 0;
 }
 
+// page_t of every frame below the user zone, indexed by pfn
 static page_t *kpages;
 
-static buddy_t *kern_bd;
+static zone_t zones[NR_ZONES];
+
+inline static bool page_in_zone(zone_t *zone, page_t *page) {
+    return page >= zone->pages && page < zone->pages + zone->npages;
+}
 
-static size_t bd_page_off = 0;
+inline static zone_t *page2zone(page_t *page) {
+    if (page_in_zone(zones + ZONE_USER, page))
+        return zones + ZONE_USER;
+    return zones + ZONE_KERN;
+}
 
-inline uintptr_t page2kpaddr(page_t *page) {
-    return (page - kpages) << PAGE_SHIFT;
+inline paddr_t page2kpaddr(page_t *page) {
+    zone_t *uzone = zones + ZONE_USER;
+    if (page_in_zone(uzone, page))
+        return uzone->pbase + ((paddr_t)(page - uzone->pages) << PAGE_SHIFT);
+    return (paddr_t)(page - kpages) << PAGE_SHIFT;
 }
 
 inline uintptr_t page2kvaddr(page_t *page) {
-    return page2kpaddr(page) + KERNBASE;
+    paddr_t pa = page2kpaddr(page);
+    // pages above the linear map go through kmap
+    assert(pa < KMEMSIZE);
+    return KADDRP2V(pa);
 }
 
-inline page_t *kpaddr2page(uintptr_t paddr) {
-    return (paddr >> PAGE_SHIFT) + kpages;
+inline page_t *kpaddr2page(paddr_t paddr) {
+    zone_t *uzone = zones + ZONE_USER;
+    if (paddr - uzone->pbase < ((paddr_t)uzone->npages << PAGE_SHIFT))
+        return uzone->pages + (size_t)((paddr - uzone->pbase) >> PAGE_SHIFT);
+    return (size_t)(paddr >> PAGE_SHIFT) + kpages;
 }
 
 inline page_t *kvaddr2page(uintptr_t vaddr) {
-    return (KADDRV2P(vaddr) >> PAGE_SHIFT) + kpages;
+    return kpaddr2page(KADDRV2P(vaddr));
 }
 
 
-static int pgdir_add(uintptr_t vaddr, uintptr_t paddr, uint32_t perm) {
-    uint32_t *pdep, *ptep;
-    pdep = PDE_PTR(vaddr);
+// tlb_invalidate - drop the stale translation of va if pgdir is the one loaded
+static inline void tlb_invalidate(pde_t *pgdir, uintptr_t va) {
+    if (rcr3() == pgdir_cr3(pgdir)) {
+        invlpg((void*)va);
+    }
+}
+
+// user space tables count their ptes and are freed with the last one,
+// kernel tables are shared by every page dir and stay
+#define pt_counted(va)  ((va) < KERNBASE)
+
+static page_t *pt_alloc(void);
+static void pt_free(page_t *page);
+
+// get_pte - return the kernel virtual address of the pte for va in pgdir,
+// allocate a page table for it if create is set.
+pte_t *get_pte(pde_t *pgdir, uintptr_t va, bool create) {
+    pde_t *pdep = pgdir + PDX(va);
     page_t *page;
-    
-    if (!PAGE_P(*pdep)) {
-        if ((page = kalloc_pages(1)) == NULL) {
-            warn("alloc pde failed at: %x.\n", vaddr);
-            return E_NO_MEM;
-        }
 
-        uintptr_t ppdep = page2kpaddr(page);
-        memset((void*)KADDRP2V(ppdep), 0, PAGE_SIZE);
-        *pdep = ppdep | perm | PTE_P;
+    // 2M mapping has no page table
+    assert(!(*pdep & PTE_PS));
+
+    if (!(*pdep & PTE_P)) {
+        if (!create || (page = pt_alloc()) == NULL)
+            return NULL;
+
+        *pdep = page2kpaddr(page) | PTE_USER;
     }
 
-    assert(*pdep & PTE_P);
+    // page tables are kernel zone pages, always linear mapped
+    return (pte_t*)KADDRP2V(PDE_ADDR(*pdep)) + PTX(va);
+}
 
-    ptep = PTE_PTR(vaddr);
-    if (!(*ptep & PTE_P)) {
-        *ptep = paddr | perm | PTE_P; 
-    } else {
-        warn("pte exist at: %x.\n", vaddr);
+// pgdir_map_page - map page at va in pgdir, take a reference on page
+int pgdir_map_page(pde_t *pgdir, uintptr_t va, page_t *page, pte_t perm) {
+    pte_t *ptep;
+
+    if ((ptep = get_pte(pgdir, va, 1)) == NULL)
+        return E_NO_MEM;
+
+    if (*ptep & PTE_P) {
+        warn("pte exist at: %x.\n", va);
+        return E_INVAL;
+    }
+
+    // a movable page keeps its single mapping, a shared one stays put
+    if (page_movable(page)) {
+        page->rmap.pgdir = page->ref_count == 0 ? pgdir : NULL;
+        page->rmap.va = va;
+    }
+
+    page->ref_count++;
+    *ptep = page2kpaddr(page) | perm | PTE_P;
+    if (pt_counted(va))
+        kpaddr2page(PDE_ADDR(pgdir[PDX(va)]))->ref_count++;
+    return 0;
+}
+
+// pgdir_insert_page - back va in pgdir with a fresh zeroed page
+int pgdir_insert_page(pde_t *pgdir, uintptr_t va, pte_t perm) {
+    page_t *page;
+    int ret;
+
+    // user mappings are backed by the user zone
+    if ((page = alloc_zeroed_page(perm & PTE_U ? ZONE_USER : ZONE_KERN))
+                                                                    == NULL)
+        return E_NO_MEM;
+
+    // only mapped here, compaction may move it
+    page_set_movable(page);
+    page->rmap.pgdir = NULL;
+    page->ref_count = 0;
+    if ((ret = pgdir_map_page(pgdir, va, page, perm)) != 0)
+        kfree_pages(page, 1);
+    return ret;
+}
+
+// pgdir_replace_page - point the mapping of va at page, drop the old one
+int pgdir_replace_page(pde_t *pgdir, uintptr_t va, page_t *page, pte_t perm) {
+    pte_t *ptep = get_pte(pgdir, va, 0);
+    page_t *old;
+
+    if (ptep == NULL || !(*ptep & PTE_P))
         return E_INVAL;
+
+    old = kpaddr2page(PTE_ADDR(*ptep));
+    if (page_movable(page)) {
+        page->rmap.pgdir = page->ref_count == 0 ? pgdir : NULL;
+        page->rmap.va = va;
+    }
+
+    page->ref_count++;
+    *ptep = page2kpaddr(page) | perm | PTE_P;
+
+    if (--old->ref_count == 0)
+        kfree_pages(old, 1);
+    else if (page_movable(old))
+        old->rmap.pgdir = NULL;
+
+    tlb_invalidate(pgdir, va);
+    return 0;
+}
+
+// pgdir_map_huge - map the 2M at va to the block at page with one 2M
+// pde, PAE pdes always take them. the block stays the caller's on error
+int pgdir_map_huge(pde_t *pgdir, uintptr_t va, page_t *page, pte_t perm) {
+    pde_t *pdep = pgdir + PDX(va);
+
+    if ((va & (PTSIZE - 1)) || va >= KERNBASE || (*pdep & PTE_P))
+        return E_INVAL;
+
+    // only a 2M aligned block fits a pde
+    if (page2kpaddr(page) & (PTSIZE - 1))
+        return E_INVAL;
+
+    for (int i=0; i<NPTEENTRY; ++i)
+        page_clear(page + i);
+    page->ref_count = 1;
+    *pdep = page2kpaddr(page) | perm | PTE_PS | PTE_P;
+    return 0;
+}
+
+/*
+ * 批量 TLB 失效: 一次范围操作先把要失效的 va 记下来, 结束时统一处理.
+ * 页数不超过 tlb_batch_max 时逐个 invlpg, 否则整体刷新; 涉及 global
+ * 映射时整体刷新要翻转 CR4.PGE, 重载 cr3 清不掉 global 项.
+ * 内核区的映射所有页目录共享, 不管当前加载的是哪个页目录都要失效
+ */
+#define tlb_batch_max   32
+
+typedef struct tlb_batch {
+    pde_t       *pgdir;
+    uint32_t    nr;
+    bool        full;       // too many pages, flush everything
+    bool        global;     // some va is in the shared kernel range
+    uintptr_t   va[tlb_batch_max];
+} tlb_batch_t;
+
+// flushes done, for the checks
+static uint32_t nr_tlb_full, nr_tlb_page;
+
+inline static void tlb_batch_init(tlb_batch_t *tb, pde_t *pgdir) {
+    tb->pgdir = pgdir;
+    tb->nr = 0;
+    tb->full = tb->global = 0;
+}
+
+inline static void tlb_batch_add(tlb_batch_t *tb, uintptr_t va) {
+    if (va >= KERNBASE)
+        tb->global = 1;
+    if (tb->full)
+        return;
+    if (tb->nr == tlb_batch_max)
+        tb->full = 1;
+    else
+        tb->va[tb->nr++] = va;
+}
+
+static void tlb_batch_flush(tlb_batch_t *tb) {
+    // user mappings of a page dir not loaded are in no tlb
+    if (!tb->global && rcr3() != pgdir_cr3(tb->pgdir))
+        goto done;
+
+    if (tb->full) {
+        uint32_t cr4 = rcr4();
+        if (tb->global && (cr4 & CR4_PGE)) {
+            lcr4(cr4 & ~CR4_PGE);
+            lcr4(cr4);
+        }
+        else {
+            lcr3(rcr3());
+        }
+        nr_tlb_full++;
+    }
+    else {
+        for (uint32_t i=0; i<tb->nr; ++i)
+            invlpg((void*)tb->va[i]);
+        nr_tlb_page += tb->nr;
+    }
+
+done:
+    tb->nr = 0;
+    tb->full = tb->global = 0;
+}
+
+static void pgdir_remove_huge(pde_t *pgdir, uintptr_t va, tlb_batch_t *tb) {
+    pde_t *pdep = pgdir + PDX(va);
+    page_t *page = kpaddr2page(PDE_ADDR(*pdep));
+
+    if (--page->ref_count == 0)
+        kfree_pages(page, NPTEENTRY);
+
+    *pdep = 0;
+    tlb_batch_add(tb, ROUNDDOWN(va, PTSIZE));
+}
+
+// unmap va and drop the page, the stale translation goes to tb
+static void page_remove(pde_t *pgdir, uintptr_t va, tlb_batch_t *tb) {
+    pte_t *ptep;
+    page_t *page;
+
+    if (va < KERNBASE && (pgdir[PDX(va)] & PTE_PS)) {
+        pgdir_remove_huge(pgdir, va, tb);
+        return;
+    }
+
+    if ((ptep = get_pte(pgdir, va, 0)) == NULL || !(*ptep & PTE_P))
+        return;
+
+    page = kpaddr2page(PTE_ADDR(*ptep));
+    if (--page->ref_count == 0)
+        kfree_pages(page, 1);
+    else if (page_movable(page))
+        page->rmap.pgdir = NULL;
+
+    *ptep = 0;
+
+    // last pte gone, the table is all zero again
+    pde_t *pdep = pgdir + PDX(va);
+    if (pt_counted(va)) {
+        page = kpaddr2page(PDE_ADDR(*pdep));
+        if (--page->ref_count == 0) {
+            *pdep = 0;
+            pt_free(page);
+        }
+    }
+    tlb_batch_add(tb, va);
+}
+
+// pgdir_remove_page - unmap va in pgdir and release its page,
+// a 2M mapping goes as a whole
+void pgdir_remove_page(pde_t *pgdir, uintptr_t va) {
+    tlb_batch_t tb;
+    tlb_batch_init(&tb, pgdir);
+    page_remove(pgdir, va, &tb);
+    tlb_batch_flush(&tb);
+}
+
+// pgdir_unmap_range - unmap npages from va, one flush at the end
+void pgdir_unmap_range(pde_t *pgdir, uintptr_t va, size_t npages) {
+    uintptr_t ed = va + npages * PGSIZE;
+    tlb_batch_t tb;
+
+    tlb_batch_init(&tb, pgdir);
+    while (va < ed) {
+        pde_t pde = pgdir[PDX(va)];
+
+        // nothing mapped in this 2M, or one 2M mapping
+        if (!(pde & PTE_P) || (pde & PTE_PS)) {
+            if (pde & PTE_P)
+                page_remove(pgdir, va, &tb);
+            va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+            continue;
+        }
+
+        page_remove(pgdir, va, &tb);
+        va += PGSIZE;
+    }
+    tlb_batch_flush(&tb);
+}
+
+// pgdir_unmap_pages - unmap n scattered pages, one flush at the end
+void pgdir_unmap_pages(pde_t *pgdir, const uintptr_t *va, size_t n) {
+    tlb_batch_t tb;
+
+    tlb_batch_init(&tb, pgdir);
+    for (size_t i=0; i<n; ++i)
+        page_remove(pgdir, va[i], &tb);
+    tlb_batch_flush(&tb);
+}
+
+// pgdir_map_range - map npages consecutive pages from page at va,
+// all or nothing
+int pgdir_map_range(pde_t *pgdir, uintptr_t va, page_t *page,
+                                            size_t npages, pte_t perm) {
+    int ret;
+
+    for (size_t i=0; i<npages; ++i) {
+        if ((ret = pgdir_map_page(pgdir, va + i * PGSIZE, page + i, perm))
+                                                                    != 0) {
+            // the pages are the caller's, keep them alive
+            for (size_t j=0; j<i; ++j)
+                page[j].ref_count++;
+            pgdir_unmap_range(pgdir, va, i);
+            for (size_t j=0; j<i; ++j)
+                page[j].ref_count--;
+            return ret;
+        }
     }
+
+    // entries were not present before, nothing cached to drop
     return 0;
 }
 
+// pgdir_map_pages - map n pages given one by one at va, all or nothing
+int pgdir_map_pages(pde_t *pgdir, uintptr_t va, page_t **pages,
+                                                size_t n, pte_t perm) {
+    int ret;
+
+    for (size_t i=0; i<n; ++i) {
+        if ((ret = pgdir_map_page(pgdir, va + i * PGSIZE, pages[i], perm))
+                                                                    != 0) {
+            for (size_t j=0; j<i; ++j)
+                pages[j]->ref_count++;
+            pgdir_unmap_range(pgdir, va, i);
+            for (size_t j=0; j<i; ++j)
+                pages[j]->ref_count--;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// pgdir_protect_range - set the permission of every mapping in
+// npages from va to perm, NX stays as it was mapped
+void pgdir_protect_range(pde_t *pgdir, uintptr_t va, size_t npages,
+                                                            pte_t perm) {
+    uintptr_t ed = va + npages * PGSIZE;
+    pte_t mask = PTE_W | PTE_U;
+    tlb_batch_t tb;
+
+    perm &= mask;
+    tlb_batch_init(&tb, pgdir);
+    while (va < ed) {
+        pde_t *pdep = pgdir + PDX(va);
+
+        if (!(*pdep & PTE_P) || (*pdep & PTE_PS)) {
+            if ((*pdep & PTE_PS) && (*pdep & mask) != perm) {
+                *pdep = (*pdep & ~mask) | perm;
+                tlb_batch_add(&tb, ROUNDDOWN(va, PTSIZE));
+            }
+            va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+            continue;
+        }
+
+        pte_t *ptep = get_pte(pgdir, va, 0);
+        if ((*ptep & PTE_P) && (*ptep & mask) != perm) {
+            *ptep = (*ptep & ~mask) | perm;
+            tlb_batch_add(&tb, va);
+        }
+        va += PGSIZE;
+    }
+    tlb_batch_flush(&tb);
+}
+
+/*
+ * 每个地址空间一个页目录: PAE 下是连续四页, 每页管 1G. 页目录指针表
+ * 单独从 pdpt_cache 取 32 字节, 记在页目录首页的 page_t 里, cr3 指向它.
+ * 不放进页目录本身, 否则 cpu 也会把它当成最高 8M 的 pde 来走, 置上
+ * 指针表项保留的 A 位. KERNBASE 以上的 pde 从 boot_pgdir 复制, 内核
+ * 页表在启动时就已建好, 之后不再增加, 所以复制一次就始终一致;
+ * 用户区从空开始, 各分区的映射互不可见
+ */
+static kmem_cache_t *pdpt_cache;
+
+pde_t *pgdir_create(void) {
+    page_t *page;
+    pde_t *pgdir, *pdpt;
+
+    if ((pdpt = kmem_cache_alloc(pdpt_cache)) == NULL)
+        return NULL;
+    if ((page = kalloc_pages(NPDPTENTRY)) == NULL) {
+        kmem_cache_free(pdpt_cache, pdpt);
+        return NULL;
+    }
+
+    page->ref_count = 0;
+    page->pdpt = pdpt;
+    pgdir = (pde_t*)page2kvaddr(page);
+    memset(pgdir, 0, PDX(KERNBASE) * sizeof(pde_t));
+    memcpy(pgdir + PDX(KERNBASE), boot_pgdir + PDX(KERNBASE),
+                        (NPDEENTRY - PDX(KERNBASE)) * sizeof(pde_t));
+
+    // pointer table entries take P only, no W, U or NX
+    for (int i=0; i<NPDPTENTRY; ++i)
+        pdpt[i] = (page2kpaddr(page) + i * PGSIZE) | PTE_P;
+    return pgdir;
+}
+
+// every user mapping must be gone, so are the page tables with them
+void pgdir_destroy(pde_t *pgdir) {
+    assert(pgdir && pgdir != boot_pgdir);
+
+    for (uint32_t i=0; i<PDX(KERNBASE); ++i)
+        assert(pgdir[i] == 0);
+
+    if (rcr3() == pgdir_cr3(pgdir))
+        lcr3(boot_cr3);
+    page_t *page = kvaddr2page((uintptr_t)pgdir);
+    kmem_cache_free(pdpt_cache, page->pdpt);
+    page->pdpt = NULL;
+    kfree_pages(page, NPDPTENTRY);
+}
+
+uintptr_t pgdir_cr3(pde_t *pgdir) {
+    return KADDRV2P(kvaddr2page((uintptr_t)pgdir)->pdpt);
+}
+
 static void init_reserved_pages(uintptr_t reserved_end) {
     page_t *page = kpages;
     for (uintptr_t st = 0; st < reserved_end; st += PAGE_SIZE) {
@@ -205,50 +652,155 @@ static void set_page_zero(uintptr_t pst, uintptr_t ped) {
     }
 }
 
-static void map_kern_addr_liner(uintptr_t ed) {
+uint32_t cache_colors = CACHE_COLORS_DEF;
+
+// colors of the highest level cache from cpuid leaf 4: pages in one way
+static void cache_color_init(void) {
+    uint32_t max, eax, ebx, ecx, way = 0;
+    int level = 0;
+
+    cpuid(0, &max, NULL, NULL, NULL);
+    for (uint32_t i=0; max >= 4 && i<16; ++i) {
+        cpuid_count(4, i, &eax, &ebx, &ecx, NULL);
+        // no more caches
+        if ((eax & 0x1f) == 0)
+            break;
+        // data or unified only
+        if ((eax & 0x1f) == 2 || (int)((eax >> 5) & 7) <= level)
+            continue;
+
+        level = (eax >> 5) & 7;
+        // line size * partitions * sets
+        way = ((ebx & 0xfff) + 1) * (((ebx >> 12) & 0x3ff) + 1) * (ecx + 1);
+    }
+
+    if (way >= PAGE_SIZE) {
+        cache_colors = 1 << bsr(way >> PAGE_SHIFT);
+        if (cache_colors > CACHE_COLORS_MAX)
+            cache_colors = CACHE_COLORS_MAX;
+    }
+    cprintf("cache colors: %d, L%d\n", cache_colors, level);
+}
+
+// turn on no execute if the cpu has it, PTE_NX is a reserved bit before
+static void enable_nx(void) {
+    uint32_t max, edx;
+    cpuid(0x80000000, &max, NULL, NULL, NULL);
+    if (max < 0x80000001)
+        return;
+
+    cpuid(0x80000001, NULL, NULL, NULL, &edx);
+    if (!(edx & CPUID_NX))
+        return;
+
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    pte_nx = PTE_NX;
+}
+
+// turn on global pages, kernel mappings then survive cr3 reloads
+static void enable_pge(void) {
+    uint32_t edx;
+    cpuid(1, NULL, NULL, NULL, &edx);
+    if (edx & CPUID_PGE)
+        lcr4(rcr4() | CR4_PGE);
+}
+
+// map pa [0, ed) at KERNBASE in one pass, the first 4M is the boot map
+// with the kernel image, the rest is data and takes NX. the zones are
+// not up yet, a page table for the tail is taken at *early
+static void map_kern_addr_liner(uintptr_t ed, uintptr_t *early) {
     cprintf("__boot_pgdir: %x\n", __boot_pgdir);
     cprintf("boot_pgdir: %x\n", boot_pgdir);
 
-    // do self map
-    uintptr_t pboot_pgdir = KADDRV2P((uintptr_t)boot_pgdir);
-    boot_pgdir[1023] = pboot_pgdir | PTE_P | PTE_W;
+    pde_t *pdep;
+    pte_t *pt;
 
-    
+    for (uintptr_t addr = 2 * PTSIZE; addr < ed; addr += PTSIZE) {
+        pdep = boot_pgdir + PDX(addr + KERNBASE);
 
-    for (uintptr_t addr = 0x400000; addr < ed; addr += PGSIZE) {
-        if (pgdir_add(addr + KERNBASE, addr, PTE_W) != 0) {
-            panic("map kern addr liner failed in: %x", addr);
+        if (addr + PTSIZE <= ed) {
+            *pdep = addr | pte_nx | PTE_PS | PTE_G | PTE_W | PTE_P;
+            continue;
         }
+
+        // no 2M page here, fill a whole page table at once
+        assert(*early < 2 * PTSIZE);
+        pt = (pte_t*)KADDRP2V(*early);
+        *early += PGSIZE;
+        for (int i=0; i<NPTEENTRY; ++i) {
+            uintptr_t pa = addr + i * PGSIZE;
+            pt[i] = pa < ed ? pa | pte_nx | PTE_G | PTE_W | PTE_P : 0;
+        }
+        *pdep = KADDRV2P(pt) | PTE_W | PTE_P;
     }
+
+    enable_pge();
 }
 
 
-// return end addr of bd_buff
-static uintptr_t setup_kbuddy(buddy_t *bd, size_t n) {
-    assert(bd && n);
+// return end addr of bd_buff, the buddy covers n rounded up to a power
+// of 2, the pages past n are reserved
+static uintptr_t setup_zone(zone_t *zone, buddy_t *bd, size_t n) {
+    assert(zone && bd && n);
 
     uintptr_t bd_buff = (uintptr_t)bd + sizeof(buddy_t);
-    kern_bd = bd;
-    buddy_init(bd, n, bd_buff);
+    size_t bd_pages = next_pow_of_2(n);
+    zone->bd = bd;
+    zone->npages = n;
+    buddy_init(bd, bd_pages, bd_buff);
+    if (bd_pages > n)
+        buddy_reserve(bd, n, bd_pages - n);
 
     cprintf("buddy_buff: %x\n", bd_buff);
-    bd_buff += n * 8;
+    bd_buff += buddy_buff_size(bd_pages);
     cprintf("buddy_buff_ed: %x\n", bd_buff);
     
     return bd_buff;
 }
 
+// pages of the zone no usable region covers never reach the free lists
+static void zone_reserve_holes(zone_t *zone) {
+    paddr_t cur = zone->pbase;
+    paddr_t ed = zone->pbase + ((paddr_t)zone->npages << PAGE_SHIFT);
+    paddr_t hole_ed;
+    size_t holes = 0;
+
+    for (int i=0; i<=nr_mem_regions && cur < ed; ++i) {
+        hole_ed = i < nr_mem_regions ? mem_regions[i].st : ed;
+        if (hole_ed > ed)
+            hole_ed = ed;
+
+        if (cur < hole_ed) {
+            buddy_reserve(zone->bd, (cur - zone->pbase) >> PAGE_SHIFT,
+                                            (hole_ed - cur) >> PAGE_SHIFT);
+            for (paddr_t pa = cur; pa < hole_ed; pa += PAGE_SIZE)
+                page_set_reserved(kpaddr2page(pa));
+            holes += (hole_ed - cur) >> PAGE_SHIFT;
+        }
+        if (i < nr_mem_regions && mem_regions[i].ed > cur)
+            cur = mem_regions[i].ed;
+    }
+
+    if (holes)
+        cprintf("zone %d: %d pages in holes\n", zone - zones, holes);
+}
+
 
 
 static void setup_mm_page(void) {
-    uintptr_t mem_end = get_mem_layout();
+    paddr_t mem_end = get_mem_layout();
     mem_end = ROUNDDOWN(mem_end, PAGE_SIZE);
-    size_t kern_size, user_size;
+    size_t kern_size, user_pages;
 
     extern char end[];
     uintptr_t mem_st = ROUNDUP((uintptr_t)KADDRV2P(end), PAGE_SIZE);
 
-    size_t all_mem = mem_end - mem_st;
+    // low memory is linear mapped first, the metadata may then lie
+    // anywhere in it
+    uintptr_t low_end = mem_end < KMEMSIZE ? (uintptr_t)mem_end : KMEMSIZE;
+    map_kern_addr_liner(low_end, &mem_st);
+
+    size_t all_mem = low_end - mem_st;
     kern_size = all_mem / 2 + mem_st;
 
     if (kern_size > KMAXSIZE) {
@@ -259,93 +811,911 @@ static void setup_mm_page(void) {
     }
 
     size_t kern_pages = kern_size >> PAGE_SHIFT;
+    // user zone gets at most what is left behind kernel zone, high
+    // memory included
+    size_t max_user_pages = 0;
+    if (mem_end > mem_st + kern_size)
+        max_user_pages = (mem_end - mem_st - kern_size) >> PAGE_SHIFT;
+
+    // the user buddy spans a power of 2, it shrinks until its nodes and
+    // page_t take at most a quarter of low memory
+    size_t meta_max = all_mem / 4;
+    size_t user_bd_pages = max_user_pages ? next_pow_of_2(max_user_pages) : 0;
+    while (user_bd_pages && buddy_buff_size(user_bd_pages) +
+            (max_user_pages < user_bd_pages ? max_user_pages : user_bd_pages)
+                                            * sizeof(page_t) > meta_max)
+        user_bd_pages >>= 1;
+    if (max_user_pages > user_bd_pages)
+        max_user_pages = user_bd_pages;
+
     // setup kern page
     size_t add_mem = 0;
-    size_t nkpages = ((kern_size + mem_st) >> PAGE_SHIFT);
-    // another one page_t for buddy_t;
-    add_mem = (nkpages + 1) * sizeof(page_t);
+    size_t nkpages = ((kern_size + mem_st + PTSIZE) >> PAGE_SHIFT);
+    // buddy_t of both zones, and page_t array alignment
+    add_mem = 2 * (sizeof(buddy_t) + sizeof(page_t));
+    add_mem += nkpages * sizeof(page_t);
     // add buddy buffer
-    add_mem += kern_pages * 8;
+    add_mem += buddy_buff_size(kern_pages);
+    // user zone buddy buffer and its own page_t
+    add_mem += buddy_buff_size(user_bd_pages);
+    add_mem += max_user_pages * sizeof(page_t);
     add_mem += (add_mem >> PAGE_SHIFT) * sizeof(page_t) + sizeof(page_t);
     add_mem = ROUNDUP(add_mem, PAGE_SIZE);
 
     uintptr_t kern_st = mem_st + add_mem;
-    uintptr_t user_st = kern_st + kern_size;
-    user_size = mem_end - user_st;
-    user_size = next_pow_of_2(user_size) >> 1;
+    // 2M aligned, so user zone blocks of 2M can be mapped by one pde
+    uintptr_t user_st = ROUNDUP(kern_st + kern_size, PTSIZE);
+    // every page up to the last region, holes are reserved later, pages
+    // past KMEMSIZE are high and only reached through kmap
+    user_pages = 0;
+    if (mem_end > user_st)
+        user_pages = (mem_end - user_st) >> PAGE_SHIFT;
+    if (user_pages > max_user_pages) {
+        cprintf("user zone: %dM left out, no room for its page_t\n",
+                            (user_pages - max_user_pages) >> (20 - PAGE_SHIFT));
+        user_pages = max_user_pages;
+    }
 
-    size_t user_pages = user_size >> PAGE_SHIFT;
+    // kernel zone and metadata must stay inside the kernel linear map
+    assert(kern_st + kern_size <= low_end);
 
     cprintf("kern phy st: %x\n", (kern_st));
     cprintf("user phy st: %x\n", (user_st));
+    cprintf("user phy ed: %llx\n", user_st + ((paddr_t)user_pages << PAGE_SHIFT));
     cprintf("kern phy pages: %d\n", kern_pages);
     cprintf("user phy pages: %d\n", user_pages);
     cprintf("mem st: %x\n", mem_st);
 
     // set up buddy system
-    kpages = (page_t*)setup_kbuddy((buddy_t*)(KADDRP2V(mem_st)), kern_pages);
-    kpages = (page_t*)ADDRALIGN((uintptr_t)kpages, sizeof(page_t));
-    assert((uintptr_t)kpages < KADDRP2V(0x400000));
+    uintptr_t meta = KADDRP2V(mem_st);
+    meta = setup_zone(zones + ZONE_KERN, (buddy_t*)meta, kern_pages);
+    if (user_pages)
+        meta = setup_zone(zones + ZONE_USER, (buddy_t*)meta, user_pages);
 
-    bd_page_off = kern_st  >> PAGE_SHIFT;
-    
-    
-    map_kern_addr_liner(user_st);
+    kpages = (page_t*)ADDRALIGN(meta, sizeof(page_t));
+
+    zones[ZONE_KERN].pages = kpages + (kern_st >> PAGE_SHIFT);
+    zones[ZONE_KERN].pbase = kern_st;
+
+    zones[ZONE_USER].pages = (page_t*)ADDRALIGN((uintptr_t)(kpages + 
+                                (user_st >> PAGE_SHIFT)), sizeof(page_t));
+    zones[ZONE_USER].pbase = user_st;
+    assert((uintptr_t)(zones[ZONE_USER].pages + user_pages) <= 
+                                                        KADDRP2V(kern_st));
 
     init_reserved_pages(kern_st);
 
     set_page_zero(kern_st, user_st);
+    memset(zones[ZONE_USER].pages, 0, user_pages * sizeof(page_t));
+
+    zone_reserve_holes(zones + ZONE_KERN);
+    if (user_pages)
+        zone_reserve_holes(zones + ZONE_USER);
 
+    kvaddr2page((uintptr_t)boot_pgdir)->pdpt = __boot_pdpt;
 }
 
 
+static void check_kmalloc(void);
+static void check_compact(void);
+static void check_zero_pool(void);
+static void check_pt_cache(void);
+static void check_tlb_batch(void);
+static void check_pgdir(void);
+static void kmap_init(void);
+static void check_kmap(void);
+
 /* pmm_init - initialize the physical memory management */
 void
 pmm_init(void) {
 
-    boot_cr3 = KADDRV2P(boot_pgdir);
-    map_kern_addr_liner(0);
+    boot_cr3 = KADDRV2P(__boot_pdpt);
     gdt_init();
+    enable_nx();
     setup_mm_page();
+    kmap_init();
+    cache_color_init();
 
     slab_init();
+    check_kmalloc();
+
+    pdpt_cache = kmem_cache_create("pdpt", NPDPTENTRY * sizeof(pde_t),
+                                    NPDPTENTRY * sizeof(pde_t), NULL);
+    assert(pdpt_cache);
+
+    vmalloc_init();
+    check_compact();
+    check_zero_pool();
+    check_pt_cache();
+    check_tlb_batch();
+    check_pgdir();
+    check_kmap();
+    check_tlsf();
+
+    ppool_init();
 
     cprintf("pmm init done.\n");
 }
 
 
-page_t *kalloc_pages(size_t n) {
-    if (n == 0)
+/*
+ * 预先清零的页池: 每个 zone 一条经 page_t 串起的单链表, idle 时补到
+ * zero_pool_high, 页表和按需清零的缺页直接取用, 不在分配路径上 memset.
+ * 内存紧张时先把池里的页还给 buddy
+ */
+#define zero_pool_high  16
+
+// kernel zone pages become page tables, user zone pages get mapped
+#define zone_zero_mt(zone_id)   \
+            ((zone_id) == ZONE_USER ? MIGRATE_MOVABLE : MIGRATE_UNMOVABLE)
+
+static page_t *alloc_pages_mt(uint32_t zone_id, size_t n, int mt);
+
+inline static bool intr_save(void) {
+    if (read_eflags() & FL_IF) {
+        intr_disable();
+        return 1;
+    }
+    return 0;
+}
+
+inline static void intr_restore(bool flag) {
+    if (flag)
+        intr_enable();
+}
+
+
+/*
+ * kmap: KMEMSIZE 以上的页 (用户区的高端部分, 可到 4G 以上) 没有线性映射,
+ * 要读写时临时映射到 KMAP_BASE 起的一个槽位, 用完 kunmap 交还.
+ * 槽位的页表启动时建好, 所有页目录共享; 低端的页直接返回线性地址
+ */
+#define KMAP_SLOTS  32
+
+static pte_t *kmap_pt;
+static uint32_t kmap_used;      // bit n set if slot n is taken
+
+static void kmap_init(void) {
+    assert(KMAP_BASE + KMAP_SLOTS * PGSIZE <= KMAP_END);
+    if ((kmap_pt = get_pte(boot_pgdir, KMAP_BASE, 1)) == NULL)
+        panic("kmap page table alloc failed.\n");
+}
+
+static void *kmap_slot(paddr_t pa) {
+    bool flag = intr_save();
+    // callers hold one or two slots at a time
+    assert(kmap_used != 0xffffffff);
+    uint32_t i = bsf(~kmap_used);
+    kmap_used |= 1U << i;
+    kmap_pt[i] = pa | pte_nx | PTE_G | PTE_W | PTE_P;
+    intr_restore(flag);
+    return (void*)(KMAP_BASE + i * PGSIZE);
+}
+
+void *kmap(page_t *page) {
+    paddr_t pa = page2kpaddr(page);
+    if (pa < KMEMSIZE)
+        return (void*)KADDRP2V(pa);
+    return kmap_slot(pa);
+}
+
+void kunmap(void *va) {
+    uintptr_t addr = (uintptr_t)va;
+    if (addr < KMAP_BASE || addr >= KMAP_BASE + KMAP_SLOTS * PGSIZE)
+        return;
+
+    uint32_t i = (addr - KMAP_BASE) >> PGSHIFT;
+    bool flag = intr_save();
+    kmap_pt[i] = 0;
+    invlpg(va);
+    kmap_used &= ~(1U << i);
+    intr_restore(flag);
+}
+
+void page_clear(page_t *page) {
+    void *p = kmap(page);
+    memset(p, 0, PAGE_SIZE);
+    kunmap(p);
+}
+
+void page_copy(page_t *dst, page_t *src) {
+    void *d = kmap(dst), *s = kmap(src);
+    memcpy(d, s, PAGE_SIZE);
+    kunmap(s);
+    kunmap(d);
+}
+
+static uint32_t zero_pool_drain(zone_t *zone) {
+    page_t *page;
+
+    bool flag = intr_save();
+    uint32_t n = zone->nr_zero;
+    while ((page = zone->zero_list) != NULL) {
+        zone->zero_list = page->zero_next;
+        page->zero_next = NULL;
+        free_page_buddy(zone->bd, page - zone->pages, 1);
+    }
+    zone->nr_zero = 0;
+    intr_restore(flag);
+    return n;
+}
+
+page_t *alloc_zeroed_page(uint32_t zone_id) {
+    zone_t *zone = zones + zone_id;
+    page_t *page;
+
+    bool flag = intr_save();
+    if ((page = zone->zero_list) != NULL) {
+        zone->zero_list = page->zero_next;
+        zone->nr_zero--;
+        page->zero_next = NULL;
+    }
+    intr_restore(flag);
+
+    if (page)
+        return page;
+
+    if ((page = alloc_pages_mt(zone_id, 1, zone_zero_mt(zone_id))) != NULL)
+        page_clear(page);
+    return page;
+}
+
+void zero_pool_refill(void) {
+    for (uint32_t id = 0; id < NR_ZONES; ++id) {
+        zone_t *zone = zones + id;
+        if (zone->bd == NULL)
+            continue;
+
+        // leave the last free pages to real allocations
+        while (zone->nr_zero < zero_pool_high &&
+                        zone->bd->free_pages > 2 * zero_pool_high) {
+            bool flag = intr_save();
+            int off = alloc_page_buddy_mt(zone->bd, 1, zone_zero_mt(id));
+            intr_restore(flag);
+            if (off < 0)
+                break;
+
+            // irq stays on while the page is cleared
+            page_t *page = zone->pages + off;
+            page->bd_size = 1;
+            page_clear(page);
+
+            flag = intr_save();
+            page->zero_next = zone->zero_list;
+            zone->zero_list = page;
+            zone->nr_zero++;
+            intr_restore(flag);
+        }
+    }
+}
+
+
+/*
+ * 页表页缓存: 只放全零的页表页, get_pte 先从这里取.
+ * 用户区页表页的 ref_count 记其中有效 pte 的个数, 最后一项移除时页表
+ * 本来就是全零, 直接回到缓存, 不用再清零, 也不经过 buddy
+ */
+#define pt_cache_max    64
+
+static page_t   *pt_cache;
+static uint32_t nr_pt_cache;
+
+static page_t *pt_alloc(void) {
+    page_t *page;
+
+    bool flag = intr_save();
+    if ((page = pt_cache) != NULL) {
+        pt_cache = page->zero_next;
+        nr_pt_cache--;
+        page->zero_next = NULL;
+    }
+    intr_restore(flag);
+
+    if (page == NULL && (page = alloc_zeroed_page(ZONE_KERN)) == NULL)
+        return NULL;
+
+    page->ref_count = 0;
+    return page;
+}
+
+// page must be an all zero page table
+static void pt_free(page_t *page) {
+    bool flag = intr_save();
+    if (nr_pt_cache < pt_cache_max) {
+        page->zero_next = pt_cache;
+        pt_cache = page;
+        nr_pt_cache++;
+        page = NULL;
+    }
+    intr_restore(flag);
+
+    if (page)
+        kfree_pages(page, 1);
+}
+
+static uint32_t pt_cache_drain(void) {
+    page_t *page;
+
+    bool flag = intr_save();
+    uint32_t n = nr_pt_cache;
+    while ((page = pt_cache) != NULL) {
+        pt_cache = page->zero_next;
+        page->zero_next = NULL;
+        kfree_pages(page, 1);
+    }
+    nr_pt_cache = 0;
+    intr_restore(flag);
+    return n;
+}
+
+int pt_reserve(uint32_t n) {
+    page_t *page;
+
+    if (n > pt_cache_max)
+        n = pt_cache_max;
+    while (nr_pt_cache < n) {
+        if ((page = alloc_zeroed_page(ZONE_KERN)) == NULL)
+            return E_NO_MEM;
+        pt_free(page);
+    }
+    return 0;
+}
+
+
+/*
+ * 页着色: 物理页号的低 log2(cache_colors) 位就是末级 cache 组号的高位,
+ * 同色的页才会争用同一批 cache 组. 用户区按色各一条单页链, 链空时从
+ * buddy 取一整块 cache_colors 页拆成单页, 每色正好一页, 其余颜色留在
+ * 链上给别的分区. 内存紧张时链上的页逐页还给 buddy, 一块的页都回去后
+ * buddy 自然把它合并回来
+ */
+static int color_refill(zone_t *zone) {
+    page_t *page;
+
+    page = alloc_pages_mt(zone - zones, cache_colors, MIGRATE_UNMOVABLE);
+    if (page == NULL)
+        return E_NO_MEM;
+
+    buddy_split(zone->bd, page - zone->pages, bsr(cache_colors));
+    for (uint32_t i=0; i<cache_colors; ++i) {
+        page[i].bd_size = 1;
+        free_color_page(page + i);
+    }
+    return 0;
+}
+
+static uint32_t color_drain(zone_t *zone) {
+    page_t *page;
+    uint32_t n;
+
+    bool flag = intr_save();
+    n = zone->nr_color;
+    for (uint32_t i=0; i<cache_colors; ++i) {
+        while ((page = zone->color_list[i]) != NULL) {
+            zone->color_list[i] = page->color.next;
+            page->color.next = NULL;
+            free_page_buddy(zone->bd, page - zone->pages, 1);
+        }
+    }
+    zone->nr_color = 0;
+    intr_restore(flag);
+    return n;
+}
+
+page_t *alloc_color_page(uint32_t color) {
+    zone_t *zone = zones + ZONE_USER;
+    page_t *page;
+
+    assert(color < cache_colors);
+    while (1) {
+        bool flag = intr_save();
+        if ((page = zone->color_list[color]) != NULL) {
+            zone->color_list[color] = page->color.next;
+            zone->nr_color--;
+        }
+        intr_restore(flag);
+
+        if (page)
+            break;
+        if (color_refill(zone) != 0)
+            return NULL;
+    }
+
+    page->color.next = NULL;
+    page->ref_count = 0;
+    return page;
+}
+
+void free_color_page(page_t *page) {
+    zone_t *zone = zones + ZONE_USER;
+    uint32_t color = page2color(page);
+
+    assert(page_in_zone(zone, page) && page->bd_size == 1);
+
+    bool flag = intr_save();
+    page->color.next = zone->color_list[color];
+    zone->color_list[color] = page;
+    zone->nr_color++;
+    intr_restore(flag);
+}
+
+static page_t *alloc_pages_mt(uint32_t zone_id, size_t n, int mt) {
+    zone_t *zone = zones + zone_id;
+    if (n == 0 || zone->bd == NULL)
         return NULL;
     
+    // kernel zone short of memory, take back empty slabs and retry,
+    // then compact once for a block of more than one page
     int bd_off;
-    if ((bd_off = alloc_page_buddy(kern_bd, n)) < 0)
-        return NULL;
+    bool compacted = 0;
+    while ((bd_off = alloc_page_buddy_mt(zone->bd, n, mt)) < 0) {
+        if (zone_id == ZONE_KERN && slab_try_release_cache() > 0)
+            continue;
+        if (zero_pool_drain(zone) > 0)
+            continue;
+        if (zone_id == ZONE_USER && color_drain(zone) > 0)
+            continue;
+        if (zone_id == ZONE_KERN && pt_cache_drain() > 0)
+            continue;
+        if (n == 1 || compacted ||
+                zone_compact(zone_id, bsr(next_pow_of_2(n))) != 0)
+            return NULL;
+        compacted = 1;
+    }
     
-    page_t *page = kpages + bd_off + bd_page_off;
+    page_t *page = zone->pages + bd_off;
     page->bd_size = n;
     return page;
 }
 
+page_t *alloc_pages(uint32_t zone_id, size_t n) {
+    return alloc_pages_mt(zone_id, n, MIGRATE_UNMOVABLE);
+}
+
+page_t *alloc_movable_page(uint32_t zone_id) {
+    page_t *page = alloc_pages_mt(zone_id, 1, MIGRATE_MOVABLE);
+    if (page) {
+        page_set_movable(page);
+        page->rmap.pgdir = NULL;
+    }
+    return page;
+}
+
+int zone_stat(uint32_t zone_id, buddy_stat_t *st) {
+    if (zone_id >= NR_ZONES || zones[zone_id].bd == NULL)
+        return E_INVAL;
+
+    buddy_stat(zones[zone_id].bd, st);
+    return 0;
+}
+
+page_t *kalloc_pages(size_t n) {
+    return alloc_pages(ZONE_KERN, n);
+}
+
+// free pages of any zone
 void kfree_pages(page_t *page, size_t n) {
     assert(page);
     if (n == 0)
         return;
 
     if (page->bd_size != n)
-        warn("kfree pages bd_size not match at: %x", page2kvaddr(page));
+        warn("kfree pages bd_size not match at: %llx", page2kpaddr(page));
+
+    // pages of a partition pool go back to their pool
+    if (page_pool(page)) {
+        ppool_free_pages(page2pool(page), page, n);
+        return;
+    }
+
+    if (page_movable(page)) {
+        page_clear_movable(page);
+        page->rmap.pgdir = NULL;
+    }
+
+    zone_t *zone = page2zone(page);
+    free_page_buddy(zone->bd, page - zone->pages, n);
+}
+
+
+/*
+ * compaction: 找一个对齐的 2^order 块, 其中已用的都是可移动的单页,
+ * 先把块内空闲部分从 buddy 摘下, 再把每个已用页复制到块外的新页并改写
+ * 唯一的那条映射, 最后整块还给 buddy 合并
+ */
+
+// order of the live block holding index, stop at order
+static int block_order(buddy_t *bd, uint32_t index, int order) {
+    int o = bd->level;
+    uint32_t head = 0;
+
+    // the first node of a live block keeps the order of the smallest
+    // live block starting there
+    while (o > order && buddy_node(bd, head)->order < o) {
+        --o;
+        head = index & ~((1 << o) - 1);
+    }
+    return o;
+}
+
+// used pages of a block if all of them can move, -1 if not
+static int block_movable_pages(zone_t *zone, uint32_t index, int order) {
+    buddy_t *bd = zone->bd;
+    uint32_t ed = index + (1 << order);
+    int used = 0;
+
+    if (block_order(bd, index, order) != order)
+        return -1;
+
+    while (index < ed) {
+        buddy_node_t *node = buddy_node(bd, index);
+        page_t *page = zone->pages + index;
+        if (!node->free) {
+            if (node->order != 0 || !page_movable(page) ||
+                            page->ref_count != 1 || !page->rmap.pgdir)
+                return -1;
+            ++used;
+        }
+        index += 1 << node->order;
+    }
+    return used;
+}
+
+// copy page to a new movable page and point its mapping there
+static int migrate_page(zone_t *zone, page_t *page) {
+    pde_t *pgdir = page->rmap.pgdir;
+    uintptr_t va = page->rmap.va;
+    pte_t *ptep = get_pte(pgdir, va, 0);
+    int off;
+
+    if (!ptep || PTE_ADDR(*ptep) != page2kpaddr(page))
+        return E_INVAL;
+    if ((off = alloc_page_buddy_mt(zone->bd, 1, MIGRATE_MOVABLE)) < 0)
+        return E_NO_MEM;
+
+    page_t *npage = zone->pages + off;
+    page_copy(npage, page);
+    *npage = *page;
+
+    *ptep = page2kpaddr(npage) | PTE_FLAGS(*ptep);
+    // kernel mappings are global, shared by every page dir
+    if (va >= KERNBASE)
+        invlpg((void*)va);
+    else
+        tlb_invalidate(pgdir, va);
+
+    page->ref_count = 0;
+    page_clear_movable(page);
+    page->rmap.pgdir = NULL;
+    return 0;
+}
+
+static int compact_block(zone_t *zone, uint32_t index, int order) {
+    buddy_t *bd = zone->bd;
+    uint32_t i, ed = index + (1 << order);
+    int ret = 0;
+
+    // the range is already a free block, or lies in one
+    buddy_node_t *head = buddy_node(bd, index & ~((1 << block_order(bd,
+                                                    index, order)) - 1));
+    if (head->free)
+        return 0;
+
+    if (block_movable_pages(zone, index, order) < 0)
+        return E_INVAL;
+
+    // free parts leave the buddy first, new pages never land inside
+    buddy_isolate(bd, index, order);
+
+    for (i = index; i < ed; i += 1 << buddy_node(bd, i)->order) {
+        page_t *page = zone->pages + i;
+        if (page_movable(page) && (ret = migrate_page(zone, page)) != 0)
+            break;
+    }
+
+    // give back isolated blocks and migrated pages, they merge
+    for (i = index; i < ed; ) {
+        page_t *page = zone->pages + i;
+        uint32_t n = 1 << buddy_node(bd, i)->order;
+        if (!page_movable(page))
+            free_page_buddy(bd, i, n);
+        i += n;
+    }
+    return ret;
+}
+
+// pages one compaction looks at, at least one block, it runs on the
+// allocation path
+#define COMPACT_SCAN_PAGES  1024
+
+int zone_compact(uint32_t zone_id, int order) {
+    if (zone_id >= NR_ZONES || zones[zone_id].bd == NULL)
+        return E_INVAL;
+
+    zone_t *zone = zones + zone_id;
+    buddy_t *bd = zone->bd;
+    int best = -1, best_used = 0;
+
+    // used pages of the block must fit in the free pages outside it
+    if (order > bd->level || bd->free_pages < (1U << order))
+        return E_NO_MEM;
+
+    uint32_t blocks = zone->npages >> order;
+    uint32_t nr_scan = COMPACT_SCAN_PAGES >> order;
+    if (blocks == 0)
+        return E_NO_MEM;
+    if (nr_scan == 0)
+        nr_scan = 1;
+    if (nr_scan > blocks)
+        nr_scan = blocks;
+
+    // the block needing fewest copies in the window, wraps at the end
+    uint32_t blk = (zone->compact_next >> order) % blocks;
+    for (uint32_t i = 0; i < nr_scan; ++i, blk = (blk + 1) % blocks) {
+        uint32_t index = blk << order;
+        int used = block_movable_pages(zone, index, order);
+        if (used < 0)
+            continue;
+        if (best < 0 || used < best_used) {
+            best = index;
+            best_used = used;
+        }
+    }
+    zone->compact_next = blk << order;
 
-    size_t bd_off = (page - kpages) - bd_page_off;
-    free_page_buddy(kern_bd, bd_off, n);
+    if (best < 0)
+        return E_NO_MEM;
+    return compact_block(zone, best, order);
 }
 
 
+// requests beyond the largest slab class take whole pages, the size is
+// kept in the head page_t so kfree can find the block
+static void *kmalloc_large(size_t n) {
+    size_t npages = ROUNDUP(n, PGSIZE) >> PAGE_SHIFT;
+    page_t *page;
+
+    if ((page = kalloc_pages(npages)) == NULL)
+        return NULL;
+
+    page_set_kmalloc(page);
+    page->kmsize = n;
+    return (void*)page2kvaddr(page);
+}
+
 void *kmalloc(size_t n) {
-    if (n > PGSIZE * 2)
-        panic("kamlloc arg larger than max_size: %d\n.", n);
+    if (n > slab_obj_max_size)
+        return kmalloc_large(n);
     return (void*)slab_alloc(n);
 }
 
 void kfree(void *p) {
+    if (!p)
+        return;
+
+    page_t *page = kvaddr2page((uintptr_t)p);
+    if (page_kmalloc(page)) {
+        size_t npages = ROUNDUP(page->kmsize, PGSIZE) >> PAGE_SHIFT;
+        page_clear_kmalloc(page);
+        page->kmsize = 0;
+        kfree_pages(page, npages);
+        return;
+    }
     slab_free((uintptr_t)p);
-}
\ No newline at end of file
+}
+
+static void check_kmalloc(void) {
+    size_t n = slab_obj_max_size + PGSIZE + 1;
+    uint8_t *p = kmalloc(n);
+    page_t *page = kvaddr2page((uintptr_t)p);
+
+    assert(p && ((uintptr_t)p & (PGSIZE - 1)) == 0);
+    assert(page_kmalloc(page) && page->kmsize == n);
+    memset(p, 0xa5, n);
+
+    kfree(p);
+    assert(!page_kmalloc(page));
+}
+
+static void check_compact(void) {
+    zone_t *zone = zones + ZONE_KERN;
+    buddy_t *bd = zone->bd;
+    uint8_t *p = vmalloc(4 * PGSIZE);
+    page_t *page[4];
+    assert(p);
+
+    for (int i=0; i<4; ++i) {
+        uintptr_t va = (uintptr_t)p + i * PGSIZE;
+        page[i] = kpaddr2page(PTE_ADDR(*get_pte(boot_pgdir, va, 0)));
+        assert(page_movable(page[i]) && page[i]->ref_count == 1);
+        assert(page[i]->rmap.pgdir == boot_pgdir && page[i]->rmap.va == va);
+        memset((void*)va, i + 1, PGSIZE);
+    }
+
+    // empty the 16 pages block holding the first page
+    uint32_t st = ROUNDDOWN(page[0] - zone->pages, 16);
+    uint32_t free_pages = bd->free_pages;
+    assert(compact_block(zone, st, 4) == 0);
+    assert(bd->free_pages == free_pages);
+    assert(buddy_node(bd, st & ~((1 << block_order(bd, st, 4)) - 1))->free);
+
+    for (int i=0; i<4; ++i) {
+        uintptr_t va = (uintptr_t)p + i * PGSIZE;
+        page_t *npage = kpaddr2page(PTE_ADDR(*get_pte(boot_pgdir, va, 0)));
+        uint32_t index = npage - zone->pages;
+        assert(index < st || index >= st + 16);
+        assert(npage->rmap.pgdir == boot_pgdir && npage->rmap.va == va);
+        assert(p[i * PGSIZE] == i + 1 && p[i * PGSIZE + PGSIZE - 1] == i + 1);
+        if (page[i] - zone->pages >= st && page[i] - zone->pages < st + 16)
+            assert(!page_movable(page[i]) && page[i]->ref_count == 0);
+    }
+
+    vfree(p);
+    assert(bd->free_pages == free_pages + 4);
+}
+
+static void check_zero_pool(void) {
+    zone_t *zone = zones + ZONE_KERN;
+    uint32_t free_pages = zone->bd->free_pages;
+
+    zero_pool_refill();
+    assert(zone->nr_zero == zero_pool_high);
+    assert(zone->bd->free_pages == free_pages - zero_pool_high);
+
+    // dirty a page and put it back through the buddy, the pool copy
+    // handed out next must still be clean
+    page_t *page = alloc_zeroed_page(ZONE_KERN);
+    uint32_t *p = (uint32_t*)page2kvaddr(page);
+    assert(page && zone->nr_zero == zero_pool_high - 1);
+    for (int i=0; i<PAGE_SIZE / 4; ++i)
+        assert(p[i] == 0);
+    memset(p, 0xff, PAGE_SIZE);
+    kfree_pages(page, 1);
+
+    page = alloc_zeroed_page(ZONE_KERN);
+    p = (uint32_t*)page2kvaddr(page);
+    assert(p[0] == 0 && p[PAGE_SIZE / 4 - 1] == 0);
+    kfree_pages(page, 1);
+
+    // memory pressure hands the pool back
+    assert(zero_pool_drain(zone) == zero_pool_high - 2);
+    assert(zone->zero_list == NULL && zone->bd->free_pages == free_pages);
+}
+
+static void check_pt_cache(void) {
+    // a 2M slot of user space nobody maps at boot
+    uintptr_t va = 3 * PTSIZE;
+    pde_t *pdep = boot_pgdir + PDX(va);
+    assert(!(*pdep & PTE_P));
+
+    assert(pt_reserve(2) == 0 && nr_pt_cache >= 2);
+    uint32_t n = nr_pt_cache;
+
+    assert(pgdir_insert_page(boot_pgdir, va, PTE_W) == 0);
+    assert(pgdir_insert_page(boot_pgdir, va + PGSIZE, PTE_W) == 0);
+    page_t *pt = kpaddr2page(PDE_ADDR(*pdep));
+    assert(nr_pt_cache == n - 1 && pt->ref_count == 2);
+
+    // the table goes back with its last pte, and is handed out again
+    pgdir_remove_page(boot_pgdir, va);
+    assert(*pdep & PTE_P);
+    pgdir_remove_page(boot_pgdir, va + PGSIZE);
+    assert(*pdep == 0 && nr_pt_cache == n && pt_cache == pt);
+
+    pte_t *ptep = get_pte(boot_pgdir, va, 1);
+    assert(ptep && kpaddr2page(PDE_ADDR(*pdep)) == pt);
+    for (int i=0; i<NPTEENTRY; ++i)
+        assert(ptep[i] == 0);
+    *pdep = 0;
+    pt_free(pt);
+
+    assert(pt_cache_drain() == n && pt_cache == NULL);
+}
+
+static void check_tlb_batch(void) {
+    uintptr_t va = 3 * PTSIZE;
+    const size_t n = 2 * tlb_batch_max;
+    page_t *page = kalloc_pages(n);
+    assert(page && !(boot_pgdir[PDX(va)] & PTE_P));
+
+    // the test owns the pages, mappings only add to the count
+    for (size_t i=0; i<n; ++i)
+        page[i].ref_count = 1;
+
+    assert(pgdir_map_range(boot_pgdir, va, page, 4, PTE_W) == 0);
+    for (int i=0; i<4; ++i)
+        *(uint32_t*)(va + i * PGSIZE) = i;
+    assert(page[3].ref_count == 2);
+
+    // a few pages go one by one
+    uint32_t full = nr_tlb_full, single = nr_tlb_page;
+    pgdir_protect_range(boot_pgdir, va, 4, 0);
+    assert(!(*get_pte(boot_pgdir, va + 3 * PGSIZE, 0) & PTE_W));
+    assert(nr_tlb_page == single + 4 && nr_tlb_full == full);
+    assert(*(uint32_t*)(va + 3 * PGSIZE) == 3);
+
+    // nothing to change, nothing to flush
+    pgdir_protect_range(boot_pgdir, va, 4, 0);
+    assert(nr_tlb_page == single + 4);
+
+    // a clash undoes the part already mapped
+    assert(pgdir_map_range(boot_pgdir, va - 2 * PGSIZE, page + 4, 4, PTE_W)
+                                                                != 0);
+    assert(page[4].ref_count == 1 && page[5].ref_count == 1);
+    assert(boot_pgdir[PDX(va - PGSIZE)] == 0);
+
+    pgdir_unmap_range(boot_pgdir, va, 4);
+    assert(page[3].ref_count == 1 && boot_pgdir[PDX(va)] == 0);
+
+    // a big range takes one full flush
+    assert(pgdir_map_range(boot_pgdir, va, page, n, PTE_W) == 0);
+    full = nr_tlb_full;
+    single = nr_tlb_page;
+    pgdir_unmap_range(boot_pgdir, va, n);
+    assert(nr_tlb_full == full + 1 && nr_tlb_page == single);
+    assert(boot_pgdir[PDX(va)] == 0);
+
+    for (size_t i=0; i<n; ++i)
+        page[i].ref_count = 0;
+    kfree_pages(page, n);
+}
+
+static void check_pgdir(void) {
+    uintptr_t va = 3 * PTSIZE;
+    pde_t *pgdir = pgdir_create();
+    page_t *page = kalloc_pages(1);
+    assert(pgdir && page);
+
+    assert(pgdir[PDX(KERNBASE)] == boot_pgdir[PDX(KERNBASE)]);
+    assert(pgdir[PDX(KMAP_BASE)] == boot_pgdir[PDX(KMAP_BASE)]);
+    // its own pointer table outside the page dir, one entry per page
+    // directory, and the top 8M has no pde at all
+    pde_t *pdpt = kvaddr2page((uintptr_t)pgdir)->pdpt;
+    assert(((uintptr_t)pdpt & (NPDPTENTRY * sizeof(pde_t) - 1)) == 0);
+    assert(pgdir_cr3(pgdir) == KADDRV2P(pdpt));
+    for (int i=0; i<NPDPTENTRY; ++i)
+        assert(pdpt[i] == ((KADDRV2P(pgdir) + i * PGSIZE) | PTE_P));
+    for (uintptr_t i=PDX(KGUARD_BASE); i<NPDEENTRY; ++i)
+        assert(pgdir[i] == 0 && boot_pgdir[i] == 0);
+
+    // the mapping is only seen through the new page dir
+    page->ref_count = 1;
+    assert(pgdir_map_page(pgdir, va, page, PTE_W) == 0);
+    assert(boot_pgdir[PDX(va)] == 0);
+
+    lcr3(pgdir_cr3(pgdir));
+    *(uint32_t*)va = 0x5a5a;
+    lcr3(boot_cr3);
+    assert(*(uint32_t*)page2kvaddr(page) == 0x5a5a);
+
+    pgdir_unmap_range(pgdir, va, 1);
+    assert(page->ref_count == 1 && pgdir[PDX(va)] == 0);
+    pgdir_destroy(pgdir);
+
+    page->ref_count = 0;
+    kfree_pages(page, 1);
+}
+
+static void check_kmap(void) {
+    page_t *page = kalloc_pages(1);
+    assert(page);
+    uint32_t *lin = (uint32_t*)page2kvaddr(page);
+
+    // low pages need no slot
+    assert(kmap(page) == lin);
+    kunmap(lin);
+
+    // a slot aliases the page the way it would a high one
+    uint32_t *p = kmap_slot(page2kpaddr(page));
+    uint32_t *q = kmap_slot(page2kpaddr(page));
+    assert((uintptr_t)p >= KMAP_BASE && (uintptr_t)q < KMAP_END && p != q);
+    *p = 0x5a5a;
+    assert(*lin == 0x5a5a && *q == 0x5a5a);
+    assert(!pte_nx || (*get_pte(boot_pgdir, (uintptr_t)p, 0) & PTE_NX));
+
+    kunmap(p);
+    kunmap(q);
+    assert(kmap_used == 0 && *get_pte(boot_pgdir, (uintptr_t)p, 0) == 0);
+
+    kfree_pages(page, 1);
+}
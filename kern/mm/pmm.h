@@ -2,6 +2,7 @@
 #define __KERN_MM_PMM_H__
 
 #include <types.h>
+#include <mmu.h>
 #include <memlayout.h>
 
 #define	 PG_P_1	  1	// 页表项或页目录项存在属性位
@@ -16,23 +17,6 @@
 
 #define PAGE_P(addr) ((addr) & (uintptr_t)0x1)
 
-#define PDE_INDEX(addr) ((addr) >> 22)
-#define PTE_INDEX(addr) (((addr) & 0x003ff000) >> 12)
-
-inline uint32_t* pde_ptr(uintptr_t addr) {
-    return (uint32_t*)0xfffff000 + PDE_INDEX(addr);
-}
-
-#define PDE_PTR(addr)   ((uint32_t*)0xfffff000 + PDE_INDEX(addr))
-
-inline uint32_t* pte_ptr(uintptr_t addr) {
-    return (uint32_t*)0xffc00000 + (((uint32_t)addr & 0xffc00000) >> 12) + 
-                                                            PTE_INDEX(addr); 
-}
-
-#define PTE_PTR(addr)   ((uint32_t*)0xffc00000 +\
-                     (((uint32_t)addr & 0xffc00000) >> 12) + PTE_INDEX(addr))
-
 
 inline static uint32_t
 next_pow_of_2(uint32_t x){
@@ -52,7 +36,20 @@ typedef struct page {
     uint32_t ref_count;
     uint32_t flag;
     uint32_t bd_size;       // buddy header size
-    void *slab;
+    union {
+        void *slab;
+        uint32_t kmsize;    // bytes asked by a large kmalloc
+        struct {            // the only mapping of a movable page
+            pde_t *pgdir;
+            uintptr_t va;
+        } rmap;
+        struct page *zero_next; // next page of a zeroed page list
+        pde_t *pdpt;            // pointer table of a page dir block
+        struct {            // a page of a color list or a colored pool
+            struct page *next;
+            struct ppool *pool;
+        } color;
+    };
 } page_t;
 
 #define POWOF2(x)   (((x) & (x-1)) == 0)
@@ -78,6 +75,10 @@ typedef struct page {
 #define PG_SLAB         1   // page used in slab system
 #define PG_DIRTY        2   // page has been modified
 #define PG_BDHEAD       3   // page is buddy alloc first page
+#define PG_POOL         4   // page heads a block of a partition pool
+#define PG_KMALLOC      5   // page heads a kmalloc block beyond slab sizes
+#define PG_MOVABLE      6   // page can be migrated by compaction
+#define PG_COLORED      7   // page belongs to a colored pool, see color.pool
 
 #define page_set_reserved(page)     SET_BIT(PG_RESERVED, page->flag)
 #define page_clear_reserved(page)   CLEAR_BIT(PG_RESERVED, page->flag)
@@ -95,6 +96,46 @@ typedef struct page {
 #define page_clear_bdhead(page)     CLEAR_BIT(PG_BDHEAD, page->flag)
 #define page_bdhead(page)           TEST_BIT(PG_BDHEAD, page->flag)
 
+#define page_set_pool(page)         SET_BIT(PG_POOL, page->flag)
+#define page_clear_pool(page)       CLEAR_BIT(PG_POOL, page->flag)
+#define page_pool(page)             TEST_BIT(PG_POOL, page->flag)
+
+#define page_set_kmalloc(page)      SET_BIT(PG_KMALLOC, page->flag)
+#define page_clear_kmalloc(page)    CLEAR_BIT(PG_KMALLOC, page->flag)
+#define page_kmalloc(page)          TEST_BIT(PG_KMALLOC, page->flag)
+
+#define page_set_movable(page)      SET_BIT(PG_MOVABLE, page->flag)
+#define page_clear_movable(page)    CLEAR_BIT(PG_MOVABLE, page->flag)
+#define page_movable(page)          TEST_BIT(PG_MOVABLE, page->flag)
+
+#define page_set_colored(page)      SET_BIT(PG_COLORED, page->flag)
+#define page_clear_colored(page)    CLEAR_BIT(PG_COLORED, page->flag)
+#define page_colored(page)          TEST_BIT(PG_COLORED, page->flag)
+
+// at most 32 colors, one bit each in a pool's mask; the count of the
+// last level cache is read at boot, 2M 16 way when the cpu does not say
+#define CACHE_COLORS_MAX    32
+#define CACHE_COLORS_DEF    32
+
+/* physical memory zones */
+#define ZONE_KERN   0   // kernel objects and metadata, always linear mapped
+#define ZONE_USER   1   // partition memory above the kernel zone
+#define NR_ZONES    2
+
+struct buddy;
+
+typedef struct zone {
+    struct buddy    *bd;
+    page_t          *pages;     // page_t of the first page in zone
+    paddr_t         pbase;      // physical addr of the first page in zone
+    size_t          npages;
+    struct page     *zero_list; // pages zeroed ahead of time
+    uint32_t        nr_zero;
+    struct page     *color_list[CACHE_COLORS_MAX];  // split pages by color
+    uint32_t        nr_color;
+    uint32_t        compact_next;   // page the next compaction scan starts at
+} zone_t;
+
 #define kernel_vir_base  0xc0000000
 
 #define pages_addr  (0x200000 + KERNEL_VADDR_START)
@@ -108,22 +149,109 @@ typedef struct page {
 #define vira2offset(addr)   ((ROUNDDOWN(addr, PAGE_SIZE) - kernel_vir_base) \
                                                                 >> PAGE_SHIFT)
 
-uintptr_t page2kpaddr(page_t *page);
+paddr_t page2kpaddr(page_t *page);
 
+// linear map address, only pages below KMEMSIZE have one
 uintptr_t page2kvaddr(page_t *page);
 
 page_t *kvaddr2page(uintptr_t vaddr);
 
-page_t *kpaddr2page(uintptr_t paddr);
+page_t *kpaddr2page(paddr_t paddr);
+
+// kernel address of any page, a kmap slot if it is above the linear map;
+// hold it briefly, the slots are few
+void *kmap(page_t *page);
+
+void kunmap(void *va);
+
+void page_clear(page_t *page);
+
+void page_copy(page_t *dst, page_t *src);
+
+// PTE_NX when the cpu has it, 0 if not
+extern pte_t pte_nx;
+
+// cache colors of this machine, a power of 2
+extern uint32_t cache_colors;
+
+// mask with a bit for every color
+#define cache_colors_mask() \
+            (cache_colors == 32 ? 0xffffffff : (1U << cache_colors) - 1)
+
+// cache color, the page number bits the cache set index takes
+#define page2color(page)    \
+            ((uint32_t)(page2kpaddr(page) >> PAGE_SHIFT) & (cache_colors - 1))
 
 void load_esp0(uintptr_t esp0);
 
 void pmm_init(void);
 
+page_t *alloc_pages(uint32_t zone, size_t n);
+
 page_t *kalloc_pages(size_t n);
 
+// one page that compaction may move, it must only be mapped once
+page_t *alloc_movable_page(uint32_t zone);
+
+// one zeroed page, taken from the zeroed pool when it has one
+page_t *alloc_zeroed_page(uint32_t zone);
+
+// zero pages ahead of time up to the pool high mark, called when idle
+void zero_pool_refill(void);
+
+// one user zone page of color, split from a block of every color
+page_t *alloc_color_page(uint32_t color);
+
+// back to the list of its color, not to buddy
+void free_color_page(page_t *page);
+
+// have n zeroed page tables cached before mapping a large range
+int pt_reserve(uint32_t n);
+
+// migrate movable pages to free an aligned block of 2^order pages,
+// looks at a bounded window of the zone, the next call goes on from there
+int zone_compact(uint32_t zone, int order);
+
 void kfree_pages(page_t *page, size_t n);
 
+pte_t *get_pte(pde_t *pgdir, uintptr_t va, bool create);
+
+int pgdir_map_page(pde_t *pgdir, uintptr_t va, page_t *page, pte_t perm);
+
+int pgdir_insert_page(pde_t *pgdir, uintptr_t va, pte_t perm);
+
+int pgdir_replace_page(pde_t *pgdir, uintptr_t va, page_t *page, pte_t perm);
+
+// page heads a block of NPTEENTRY pages, 2M aligned
+int pgdir_map_huge(pde_t *pgdir, uintptr_t va, page_t *page, pte_t perm);
+
+void pgdir_remove_page(pde_t *pgdir, uintptr_t va);
+
+int pgdir_map_range(pde_t *pgdir, uintptr_t va, page_t *page,
+                                            size_t npages, pte_t perm);
+
+void pgdir_unmap_range(pde_t *pgdir, uintptr_t va, size_t npages);
+
+int pgdir_map_pages(pde_t *pgdir, uintptr_t va, page_t **pages,
+                                                size_t n, pte_t perm);
+
+void pgdir_unmap_pages(pde_t *pgdir, const uintptr_t *va, size_t n);
+
+void pgdir_protect_range(pde_t *pgdir, uintptr_t va, size_t npages,
+                                                            pte_t perm);
+
+// new page dir sharing the kernel half of boot_pgdir, user half empty
+pde_t *pgdir_create(void);
+
+void pgdir_destroy(pde_t *pgdir);
+
+// cr3 of a page dir, the pa of its pointer table
+uintptr_t pgdir_cr3(pde_t *pgdir);
+
+struct buddy_stat;
+
+int zone_stat(uint32_t zone, struct buddy_stat *st);
+
 void *kmalloc(size_t n);
 
 void kfree(void *p);
@@ -132,5 +260,7 @@ extern char bootstack[], bootstacktop[];
 
 extern uintptr_t boot_cr3;
 
+extern pde_t *boot_pgdir;
+
 #endif /* !__KERN_MM_PMM_H__ */
 
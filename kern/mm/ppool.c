@@ -0,0 +1,403 @@
+#include <ppool.h>
+#include <pmm.h>
+#include <buddy.h>
+#include <assert.h>
+#include <stdio.h>
+#include <error.h>
+#include <tlsf.h>
+#include <vmalloc.h>
+#include <string.h>
+
+
+static ppool_t ppools[PPOOL_MAX];
+
+static void check_ppool(void);
+static void check_ppool_colored(void);
+
+void ppool_init(void) {
+    for (int i=0; i<PPOOL_MAX; ++i) {
+        ppools[i].id = -1;
+        ppools[i].npages = 0;
+    }
+
+    check_ppool();
+    check_ppool_colored();
+}
+
+// free pages of a colored pool back to the color lists of the user zone
+static void pool_free_colors(ppool_t *pool) {
+    page_t *page;
+    while ((page = pool->color_free) != NULL) {
+        pool->color_free = page->color.next;
+        page_clear_colored(page);
+        page->color.pool = NULL;
+        free_color_page(page);
+    }
+}
+
+// a plain pool is one contiguous block, it has pages of every color
+static bool pool_colors_taken(uint32_t colors) {
+    for (int i=0; i<PPOOL_MAX; ++i) {
+        if (ppools[i].id < 0)
+            continue;
+        uint32_t own = ppools[i].colors ? ppools[i].colors
+                                        : cache_colors_mask();
+        if (own & colors)
+            return 1;
+    }
+    return 0;
+}
+
+// carve a pool for partition id out of the user zone, quota 0 means all
+ppool_t *ppool_create(int id, size_t pages, size_t quota) {
+    if (id < 0 || id >= PPOOL_MAX || pages == 0)
+        return NULL;
+
+    ppool_t *pool = ppools + id;
+    if (pool->id >= 0) {
+        warn("ppool %d exist.\n", id);
+        return NULL;
+    }
+
+    // plain pools share every color among themselves, not with a colored one
+    for (int i=0; i<PPOOL_MAX; ++i) {
+        if (ppools[i].id >= 0 && ppools[i].colors) {
+            warn("ppool %d: colored pools exist.\n", id);
+            return NULL;
+        }
+    }
+
+    pages = next_pow_of_2(pages);
+    size_t meta_pages = ROUNDUP(buddy_buff_size(pages), PAGE_SIZE) >> PAGE_SHIFT;
+
+    if ((pool->meta = kalloc_pages(meta_pages)) == NULL)
+        return NULL;
+
+    if ((pool->pages = alloc_pages(ZONE_USER, pages)) == NULL) {
+        kfree_pages(pool->meta, meta_pages);
+        return NULL;
+    }
+
+    buddy_init(&pool->bd, pages, page2kvaddr(pool->meta));
+
+    pool->id = id;
+    pool->npages = pages;
+    pool->meta_pages = meta_pages;
+    pool->quota = (quota == 0 || quota > pages) ? pages : quota;
+    pool->used = pool->peak = 0;
+    pool->nr_alloc = pool->nr_fail = 0;
+    pool->heap = NULL;
+    pool->colors = 0;
+    pool->color_free = NULL;
+    return pool;
+}
+
+// pages taken one by one, round robin over the colors of mask
+ppool_t *ppool_create_colored(int id, size_t pages, size_t quota,
+                                                        uint32_t colors) {
+    if (id < 0 || id >= PPOOL_MAX || pages == 0 || colors == 0)
+        return NULL;
+    if (colors & ~cache_colors_mask())
+        return NULL;
+
+    ppool_t *pool = ppools + id;
+    if (pool->id >= 0) {
+        warn("ppool %d exist.\n", id);
+        return NULL;
+    }
+
+    if (pool_colors_taken(colors)) {
+        warn("ppool %d colors %x taken.\n", id, colors);
+        return NULL;
+    }
+
+    pool->color_free = NULL;
+    uint32_t color = 0;
+    for (size_t i=0; i<pages; ++i) {
+        while (!(colors & (1U << color)))
+            color = (color + 1) % cache_colors;
+
+        page_t *page = alloc_color_page(color);
+        if (page == NULL) {
+            pool_free_colors(pool);
+            return NULL;
+        }
+        color = (color + 1) % cache_colors;
+
+        page_set_colored(page);
+        page->color.pool = pool;
+        page->color.next = pool->color_free;
+        pool->color_free = page;
+    }
+
+    pool->id = id;
+    pool->pages = NULL;
+    pool->npages = pages;
+    pool->meta = NULL;
+    pool->meta_pages = 0;
+    pool->quota = (quota == 0 || quota > pages) ? pages : quota;
+    pool->used = pool->peak = 0;
+    pool->nr_alloc = pool->nr_fail = 0;
+    pool->heap = NULL;
+    pool->colors = colors;
+    return pool;
+}
+
+// give the pool back to the user zone, every page must be freed
+void ppool_destroy(ppool_t *pool) {
+    ASSERT(pool && pool->id >= 0);
+
+    if (pool->heap) {
+        // the control block heads the mapped range
+        vfree(pool->heap);
+        for (size_t i=0; i<pool->heap_npages; ++i)
+            ppool_free_pages(pool, pool->heap_pages[i], 1);
+        kfree(pool->heap_pages);
+        pool->heap = NULL;
+    }
+    ASSERT(pool->used == 0);
+
+    if (pool->colors) {
+        pool_free_colors(pool);
+        pool->colors = 0;
+    }
+    else {
+        // the head page_t carries the size of the last block handed out
+        pool->pages->bd_size = pool->npages;
+        kfree_pages(pool->pages, pool->npages);
+        kfree_pages(pool->meta, pool->meta_pages);
+    }
+
+    pool->id = -1;
+    pool->npages = 0;
+}
+
+ppool_t *ppool_get(int id) {
+    if (id < 0 || id >= PPOOL_MAX || ppools[id].id < 0)
+        return NULL;
+    return ppools + id;
+}
+
+ppool_t *page2pool(page_t *page) {
+    ppool_t *pool;
+    if (page_colored(page))
+        return page->color.pool;
+
+    for (int i=0; i<PPOOL_MAX; ++i) {
+        pool = ppools + i;
+        if (page >= pool->pages && page < pool->pages + pool->npages)
+            return pool;
+    }
+    return NULL;
+}
+
+page_t *ppool_alloc_pages(ppool_t *pool, size_t n) {
+    ASSERT(pool && pool->id >= 0);
+
+    if (n == 0)
+        return NULL;
+
+    size_t need = next_pow_of_2(n);
+    page_t *page;
+    int bd_off;
+
+    if (pool->used + need > pool->quota)
+        goto failed;
+
+    if (pool->colors) {
+        // the pages are not contiguous, one at a time
+        if (n != 1 || (page = pool->color_free) == NULL)
+            goto failed;
+        pool->color_free = page->color.next;
+        page->color.next = NULL;
+    }
+    else {
+        if ((bd_off = alloc_page_buddy(&pool->bd, n)) < 0)
+            goto failed;
+        page = pool->pages + bd_off;
+    }
+
+    page->bd_size = n;
+    page_set_pool(page);
+
+    pool->used += need;
+    if (pool->used > pool->peak)
+        pool->peak = pool->used;
+    pool->nr_alloc++;
+    return page;
+
+failed:
+    pool->nr_fail++;
+    return NULL;
+}
+
+void ppool_free_pages(ppool_t *pool, page_t *page, size_t n) {
+    ASSERT(pool && page && page_pool(page));
+    page_clear_pool(page);
+
+    if (pool->colors) {
+        ASSERT(n == 1 && page->color.pool == pool);
+        page->color.next = pool->color_free;
+        pool->color_free = page;
+    }
+    else {
+        ASSERT(page >= pool->pages && page < pool->pages + pool->npages);
+        free_page_buddy(&pool->bd, page - pool->pages, n);
+    }
+    pool->used -= next_pow_of_2(n);
+}
+
+int ppool_heap_create(ppool_t *pool, size_t pages) {
+    ASSERT(pool && pool->id >= 0);
+    if (pool->heap || pages == 0)
+        return E_INVAL;
+
+    page_t **list;
+    void *va = NULL;
+    size_t n;
+    int ret = E_NO_MEM;
+
+    if ((list = kmalloc(pages * sizeof(page_t*))) == NULL)
+        return E_NO_MEM;
+
+    // pool pages may be high or of scattered colors, the heap keeps a
+    // contiguous mapping of its own
+    for (n=0; n<pages; ++n) {
+        if ((list[n] = ppool_alloc_pages(pool, 1)) == NULL)
+            goto failed;
+    }
+    if ((va = vmap_pages(list, pages)) == NULL)
+        goto failed;
+
+    ret = E_INVAL;
+    if ((pool->heap = tlsf_create(va, pages * PAGE_SIZE)) == NULL)
+        goto failed;
+    pool->heap_pages = list;
+    pool->heap_npages = pages;
+    return 0;
+
+failed:
+    vfree(va);
+    while (n > 0)
+        ppool_free_pages(pool, list[--n], 1);
+    kfree(list);
+    return ret;
+}
+
+void *ppool_malloc(ppool_t *pool, size_t n) {
+    ASSERT(pool && pool->heap);
+    return tlsf_malloc(pool->heap, n);
+}
+
+void ppool_mfree(ppool_t *pool, void *p) {
+    ASSERT(pool && pool->heap);
+    tlsf_free(pool->heap, p);
+}
+
+
+static void check_ppool(void) {
+    const size_t quota = 16;
+    page_t *pages[quota];
+
+    ppool_t *pool = ppool_create(0, 64, quota);
+    ASSERT(pool && pool->npages == 64);
+    ASSERT(ppool_get(0) == pool && ppool_create(0, 64, quota) == NULL);
+
+    // plain pools live side by side
+    ppool_t *other = ppool_create(1, 16, 0);
+    ASSERT(other && other->pages != pool->pages);
+    ppool_destroy(other);
+
+    for (int i=0; i<quota; ++i) {
+        pages[i] = ppool_alloc_pages(pool, 1);
+        ASSERT(pages[i] && page2pool(pages[i]) == pool);
+    }
+
+    // hard quota, not memory, stops the pool
+    ASSERT(ppool_alloc_pages(pool, 1) == NULL);
+    ASSERT(pool->nr_fail == 1 && pool->used == quota);
+
+    // kfree_pages routes pool pages back to their pool
+    kfree_pages(pages[0], 1);
+    ASSERT(pool->used == quota - 1);
+    ASSERT((pages[0] = ppool_alloc_pages(pool, 1)) != NULL);
+
+    for (int i=0; i<quota; ++i)
+        ppool_free_pages(pool, pages[i], 1);
+
+    ASSERT(pool->used == 0 && pool->peak == quota);
+
+    // heap pages count in the quota and go back on destroy
+    ASSERT(ppool_heap_create(pool, 4) == 0 && pool->used == 4);
+    void *obj = ppool_malloc(pool, 100);
+    ASSERT(obj && page2pool(vmalloc2page(obj)) == pool);
+    ppool_mfree(pool, obj);
+    ASSERT(pool->heap->used == 0);
+
+    ppool_destroy(pool);
+    ASSERT(ppool_get(0) == NULL);
+
+    cprintf("check ppool pass.\n");
+}
+
+static void check_ppool_colored(void) {
+    const size_t pages = 8;
+    page_t *got[pages];
+
+    if (cache_colors < 4) {
+        cprintf("check ppool colored skipped, %d colors.\n", cache_colors);
+        return;
+    }
+
+    // two colors each, the second pool may not take a color of the first
+    ppool_t *a = ppool_create_colored(0, pages, 0, 0x3);
+    ASSERT(a && a->npages == pages && a->used == 0);
+    ASSERT(ppool_create_colored(1, pages, 0, 0x6) == NULL);
+    ppool_t *b = ppool_create_colored(1, pages, 0, 0xc);
+    ASSERT(b);
+    // a plain pool would share every color with them
+    ASSERT(ppool_create(2, pages, 0) == NULL);
+
+    for (int i=0; i<pages; ++i) {
+        got[i] = ppool_alloc_pages(a, 1);
+        ASSERT(got[i] && page2pool(got[i]) == a);
+        ASSERT((1U << page2color(got[i])) & 0x3);
+    }
+    // only single pages, and never more than were taken at create
+    ASSERT(ppool_alloc_pages(a, 1) == NULL);
+    ASSERT(ppool_alloc_pages(b, 2) == NULL);
+
+    // both colors are used evenly
+    uint32_t c0 = 0;
+    for (int i=0; i<pages; ++i)
+        c0 += page2color(got[i]) == 0;
+    ASSERT(c0 == pages / 2);
+
+    page_t *page = ppool_alloc_pages(b, 1);
+    ASSERT(page && ((1U << page2color(page)) & 0xc));
+    kfree_pages(page, 1);
+    ASSERT(b->used == 0);
+
+    for (int i=0; i<pages; ++i)
+        kfree_pages(got[i], 1);
+    ASSERT(a->used == 0 && a->peak == pages);
+
+    // the heap lines up single pages of the pool's own colors
+    ASSERT(ppool_heap_create(a, 4) == 0 && a->used == 4);
+    uint8_t *obj = ppool_malloc(a, PAGE_SIZE + 100);
+    ASSERT(obj && page2pool(vmalloc2page(obj)) == a);
+    ASSERT((1U << page2color(vmalloc2page(obj + PAGE_SIZE))) & 0x3);
+    memset(obj, 0x5a, PAGE_SIZE + 100);
+    ppool_mfree(a, obj);
+    // destroy gives the heap pages back with the rest
+
+    ppool_destroy(a);
+    ppool_destroy(b);
+    ASSERT(ppool_get(0) == NULL && ppool_get(1) == NULL);
+
+    ppool_t *plain = ppool_create(2, pages, 0);
+    ASSERT(plain && ppool_create_colored(0, pages, 0, 0x1) == NULL);
+    ppool_destroy(plain);
+
+    cprintf("check ppool colored pass.\n");
+}
@@ -0,0 +1,67 @@
+#ifndef __L_PPOOL_H
+#define __L_PPOOL_H
+
+#include <types.h>
+#include <pmm.h>
+#include <buddy.h>
+#include <apex.h>
+
+/*
+分区物理内存池，配置阶段从用户区整块切出
+每个池有独立的buddy空闲链表、用量计数和配额，分区之间互不影响
+着色池不切整块, 创建时按自己的颜色逐页取齐, 只分单页, 各池颜色不相交,
+分区之间也不共享 cache 组. 普通池是一整块, 占全部颜色, 所以不能和
+着色池同时存在
+*/
+
+// one pool per partition, one more behind the shared regions
+#define PPOOL_SHM   SYSTEM_LIMIT_NUMBER_OF_PARTITIONS
+#define PPOOL_MAX   (SYSTEM_LIMIT_NUMBER_OF_PARTITIONS + 1)
+
+typedef struct ppool {
+    int         id;         // owner partition, -1 if the slot is free
+    buddy_t     bd;         // private free lists of the pool
+    page_t      *pages;     // page_t of the first page in pool
+    size_t      npages;
+    page_t      *meta;      // pages holding the buddy node buffer
+    size_t      meta_pages;
+    size_t      quota;      // hard limit of pages in use
+    size_t      used;       // pages in use, rounded as buddy hands them out
+    size_t      peak;
+    uint32_t    nr_alloc;
+    uint32_t    nr_fail;    // failed by quota or fragmentation
+    struct tlsf *heap;      // bounded time heap, NULL if not set up
+    page_t      **heap_pages;   // single pages lined up by vmap_pages
+    size_t      heap_npages;
+    uint32_t    colors;     // cache colors of a colored pool, 0 if not
+    page_t      *color_free;    // free pages of a colored pool
+} ppool_t;
+
+void ppool_init(void);
+
+ppool_t *ppool_create(int id, size_t pages, size_t quota);
+
+// pages only of the colors set in mask, no other pool may have them,
+// a plain pool has them all
+ppool_t *ppool_create_colored(int id, size_t pages, size_t quota,
+                                                        uint32_t colors);
+
+void ppool_destroy(ppool_t *pool);
+
+ppool_t *ppool_get(int id);
+
+ppool_t *page2pool(page_t *page);
+
+page_t *ppool_alloc_pages(ppool_t *pool, size_t n);
+
+void ppool_free_pages(ppool_t *pool, page_t *page, size_t n);
+
+// give the partition a tlsf heap of pages taken from its pool one by
+// one, so a colored pool has one too
+int ppool_heap_create(ppool_t *pool, size_t pages);
+
+void *ppool_malloc(ppool_t *pool, size_t n);
+
+void ppool_mfree(ppool_t *pool, void *p);
+
+#endif
@@ -3,94 +3,233 @@
 #include <buddy.h>
 #include <assert.h>
 #include <stdio.h>
+#include <x86.h>
 
 
+#if SLAB_DEBUG
 static const uint32_t obj_removed = 0xffffffff;
+#endif
 
 // extern from mm.c
 extern const uintptr_t pages;
 
 
-static const uint32_t slab_pages[num_cached] = {1,1,1,1,2,4,4,4,4,8};
+static const uint32_t slab_sizes[num_cached] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 
+    2048, 3072, 4096, 6144, 8192
+};
 
-// if len of cache empty list larger than max_empty_slabs, free some slabs 
-static const uint32_t max_empty_slabs = 4; 
+// pages per slab, picked so that each class wastes less than 1/8 slab
+static const uint32_t slab_pages[num_cached] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 4, 4, 4, 4, 4, 8, 4, 8, 8
+};
+
+static const char *slab_names[num_cached] = {
+    "kmalloc-16", "kmalloc-24", "kmalloc-32", "kmalloc-48", "kmalloc-64",
+    "kmalloc-96", "kmalloc-128", "kmalloc-192", "kmalloc-256", 
+    "kmalloc-384", "kmalloc-512", "kmalloc-768", "kmalloc-1024", 
+    "kmalloc-1536", "kmalloc-2048", "kmalloc-3072", "kmalloc-4096", 
+    "kmalloc-6144", "kmalloc-8192"
+};
+
+// size class of requests up to 192, indexed by (n - 1) >> 3
+#define small_index_max     192
+static const uint8_t small_index[small_index_max >> 3] = {
+    0, 0, 1, 2, 3, 3, 4, 4,         // 8 .. 64
+    5, 5, 5, 5, 6, 6, 6, 6,         // 72 .. 128
+    7, 7, 7, 7, 7, 7, 7, 7          // 136 .. 192
+};
+
+// empty slabs are released by slab_reclaim out of the free path, a cache
+// above its high watermark (max_empty_pages of empty slabs) is cut to low
+static const uint32_t max_empty_pages = 8; 
+static const uint32_t min_empty_high = 2;
+
+// objects of this size and larger keep slab_t off slab
+static const uint32_t off_slab_min_size = 512;
+
+// named caches get slabs of at least min_slab_objs, up to max_slab_pages
+static const uint32_t min_slab_objs = 8;
+static const uint32_t max_slab_pages = 8;
+
+// slab color step, one cache line
+static const uint32_t cache_line_size = 64;
 
 static mem_cache_t  mcached[num_cached];
 
+// every cache, size classes first
+static list_t cache_list;
 
-inline static uint32_t size2index(uint32_t n) {
-    uint32_t res = 0;
-    for (; n; ++res, n >>= 1);
-    return res - 1;
-}
+
+// length of slab_t holding objs objects
+#if SLAB_DEBUG
+#define slab_t_len(objs)    (offset(slab_t, obj_list) + (objs) * sizeof(uint32_t))
+#define slab_obj_extra      sizeof(uint32_t)
+#else
+#define slab_t_len(objs)    (sizeof(slab_t))
+#define slab_obj_extra      0
+#endif
+
+// next free obj, stored in the free obj itself
+#define obj_link(cache, obj)    (*(uintptr_t*)((obj) + (cache)->link_off))
 
 // empty slab free strategy
 #define NORMAL_FREE 1
 #define SOFT_FREE   2
 #define FORCE_FREE  4
 
-static void try_free_empty_slabs(mem_cache_t *slot, uint32_t flag) {
-    uint32_t num_release = 0;
-    slab_t *slab;
-    list_elem_t *elem;
+static void release_slab(mem_cache_t *cache, slab_t *slab) {
     uintptr_t buff;
     page_t *page;
 
+    // colored buff is still in the first page
+    if (cache->flag & CACHE_OFF_SLAB)
+        buff = ROUNDDOWN(slab->buff, PAGE_SIZE);
+    else
+        buff = (uintptr_t)slab;
+
+    page = kvaddr2page(buff); 
+    for (int i=0; i<cache->slab_pages; ++i) {
+        page_clear_slab((page + i));
+        page[i].slab = NULL;
+    }
+    kfree_pages(page, cache->slab_pages);
+
+    if (cache->flag & CACHE_OFF_SLAB)
+        slab_free((uintptr_t)slab);
+}
+
+// return pages given back to buddy
+static uint32_t try_free_empty_slabs(mem_cache_t *slot, uint32_t flag) {
+    uint32_t num_release = 0;
+    list_elem_t *elem;
+
     if (flag & NORMAL_FREE)
-        num_release = slot->empty.len > max_empty_slabs ? \
-                                slot->empty.len - max_empty_slabs : 0;
+        num_release = slot->empty.len > slot->empty_high ? \
+                                slot->empty.len - slot->empty_low : 0;
     else if (flag & SOFT_FREE)
-        num_release = slot->empty.len / 2;
+        num_release = (slot->empty.len + 1) / 2;
     else if (flag & FORCE_FREE)
         num_release = slot->empty.len;
     else
-        return;
+        return 0;
 
     for (uint32_t i=0; i<num_release; ++i) {
         elem = list_pop_back(&slot->empty);
-        slab = tag2slab(elem);
-
-        if (i > slab_t_in_slab_index)
-            buff = slab->buff;
-        else
-            buff = (uintptr_t)slab;
-
-        page = kvaddr2page(buff); 
-        kfree_pages(page, page->bd_size);
+        release_slab(slot, tag2slab(elem));
     }
+    return num_release * slot->slab_pages;
 }
 
 
-static void empty_slab_t_init(mem_cache_t *slot, slab_t *slab, uint32_t objs) {
-    assert(slot && slab);
+static void empty_slab_t_init(mem_cache_t *slot, slab_t *slab, uint32_t objs,
+                                                            uintptr_t buff) {
+    assert(slot && slab && objs);
 
-    slab->free = 0;
     slab->total_objs = objs;
     slab->free_objs = objs;
-    slab->obj_order = slot->obj_order;
+    slab->cache = slot;
+    slab->buff = buff;
+    slab->free = buff;
+
+    uintptr_t obj = buff;
+    for (int i=0; i<objs - 1; ++i, obj += slot->obj_size)
+        obj_link(slot, obj) = obj + slot->obj_size;
+    obj_link(slot, obj) = 0;
+
+#if SLAB_DEBUG
+    for (int i=0; i<objs; ++i)
+        slab->obj_list[i] = 0;
+#endif
+}
+
+
+// pick slab size and objects per slab, pages 0 lets the cache decide
+static void cache_estimate(mem_cache_t *cache, uint32_t pages) {
+    uint32_t size = cache->obj_size;
+
+    if (pages == 0) {
+        pages = 1;
+        while (pages < max_slab_pages && 
+                        (pages << PAGE_SHIFT) < size * min_slab_objs)
+            pages <<= 1;
+    }
 
-    for (int i=0; i<objs; ++i) {
-        slab->obj_list[i] = i + 1;
+    uint32_t bytes = pages << PAGE_SHIFT;
+    cache->slab_pages = pages;
+
+    uint32_t objs, left;
+    if (size >= off_slab_min_size) {
+        cache->flag |= CACHE_OFF_SLAB;
+        objs = bytes / size;
+        left = bytes - objs * size;
+    }
+    else {
+        // slab_t shares the slab with the objects
+        objs = (bytes - slab_t_len(0)) / (size + slab_obj_extra);
+        while (objs && 
+                ROUNDUP(slab_t_len(objs), cache->align) + objs * size > bytes)
+            --objs;
+        left = bytes - ROUNDUP(slab_t_len(objs), cache->align) - objs * size;
+    }
+    cache->slab_objs = objs;
+
+    // leftover bytes shift the first obj of successive slabs, colors stay
+    // in the first page so the head page is found from slab->buff
+    cache->color_off = cache->align > cache_line_size ? 
+                                        cache->align : cache_line_size;
+    cache->colors = left / cache->color_off + 1;
+    if (cache->color_off >= PAGE_SIZE)
+        cache->colors = 1;
+    else if (cache->colors > PAGE_SIZE / cache->color_off)
+        cache->colors = PAGE_SIZE / cache->color_off;
+    cache->color_next = 0;
+}
+
+static void cache_init(mem_cache_t *cache, const char *name, uint32_t size,
+                uint32_t align, void (*ctor)(void *), uint32_t pages) {
+    if (align < sizeof(uint32_t))
+        align = sizeof(uint32_t);
+    align = next_pow_of_2(align);
+
+    cache->name = name;
+    cache->align = align;
+
+    // ctor state must survive free, so the link goes after the object
+    if (ctor) {
+        cache->link_off = ROUNDUP(size, sizeof(uintptr_t));
+        cache->obj_size = ROUNDUP(cache->link_off + sizeof(uintptr_t), align);
+    } else {
+        cache->link_off = 0;
+        cache->obj_size = ROUNDUP(size, align);
     }
+    cache->ctor = ctor;
+    cache->flag = 0;
+
+    list_init(&cache->empty);
+    list_init(&cache->full);
+    list_init(&cache->partial);
+
+    cache_estimate(cache, pages);
+
+    cache->inuse = cache->nr_alloc = cache->nr_fail = 0;
+
+    cache->empty_high = max_empty_pages / cache->slab_pages;
+    if (cache->empty_high < min_empty_high)
+        cache->empty_high = min_empty_high;
+    cache->empty_low = cache->empty_high / 2;
+
+    list_push_back(&cache_list, &cache->cache_tag);
 }
 
 
-static int fill_empty_slot(uint32_t index) {
+static int fill_empty_slot(mem_cache_t *slot) {
     // print_str_int("fill_empty_slot:", index);
-    // very complex..
-    mem_cache_t *slot = mcached + index;
     assert(list_empty(&slot->empty) && list_empty(&slot->partial));
 
-    // just add one slab in empty list
-    /* TODO
-        num of objs per slab
-        num of pages per slab
-        slab_t in slab or not
-        // there should be a threshold
-    */
-    
-    uint32_t npages = slab_pages[index];
+    // just add one slab in empty list, geometry comes from cache_estimate
+    uint32_t npages = slot->slab_pages;
+    uint32_t objs = slot->slab_objs;
     slab_t *slab;
     uintptr_t buddy_buff;
     page_t *page;
@@ -99,41 +238,32 @@ static int fill_empty_slot(uint32_t index) {
         return 1;
 
     buddy_buff = page2kvaddr(page);
-    uint32_t obj_size = 1 << slot->obj_order;
-    uint32_t objs = (npages << PAGE_SHIFT) / obj_size;
-    uint32_t slab_t_len = sizeof(slab_t) + (objs - 1) * sizeof(uint32_t);
+    uint32_t slab_len = slab_t_len(objs);
     
-    if (index > slab_t_in_slab_index) {
-        slab = (slab_t*)slab_alloc(slab_t_len);
-        if (!slab)
+    if (slot->flag & CACHE_OFF_SLAB) {
+        slab = (slab_t*)slab_alloc(slab_len);
+        if (!slab) {
+            kfree_pages(page, npages);
             return 1;
-
-        empty_slab_t_init(slot, slab, objs);
-        slab->buff = buddy_buff;
+        }
     }
     else {
         slab = (slab_t*)buddy_buff;
+        buddy_buff += ROUNDUP(slab_len, slot->align);
+    }
 
-        // resize objs
-        uint32_t slab_header_objs = slab_t_len / obj_size;
-        slab_header_objs += slab_t_len % obj_size == 0 ? 0 : 1;
-
-        uint32_t add_objs = slab_header_objs * sizeof(uint32_t) / 
-                                        (sizeof(uint32_t) + obj_size);
-        
-        objs = objs - slab_header_objs + add_objs; 
-
-        // resize slab_t_len
-        slab_t_len = sizeof(slab_t) + (objs - 1) * sizeof(uint32_t);
-
-        empty_slab_t_init(slot, slab, objs);
+    buddy_buff += slot->color_next * slot->color_off;
+    if (++slot->color_next == slot->colors)
+        slot->color_next = 0;
 
-        uint32_t align_off = ROUNDUP(slab_t_len, obj_size);
-        slab->buff = buddy_buff + align_off;
+    if (slot->ctor) {
+        for (uint32_t i=0; i<objs; ++i)
+            slot->ctor((void*)(buddy_buff + i * slot->obj_size));
     }
 
+    empty_slab_t_init(slot, slab, objs, buddy_buff);
+
     // set page_t slab flag
-    page = kvaddr2page(buddy_buff);
     // print_str_int("page_t addr:", page);
     for (int i=0; i<npages; ++i) {
         page_set_slab(page);
@@ -150,21 +280,29 @@ static uintptr_t fetch_obj_from_slab(mem_cache_t* cache, slab_t *slab) {
     assert(slab);
     assert(slab->free_objs > 0);
 
-    uint32_t free = slab->free;
+    uintptr_t obj = slab->free;
 
-    assert(free < slab->total_objs);
+    assert(obj);
 
-    slab->free = slab->obj_list[free];
+    slab->free = obj_link(cache, obj);
 
+#if SLAB_DEBUG
     // mark obj as removed
-    slab->obj_list[free] = obj_removed;
-
-    // uintptr_t obj = free * slab->obj_size + slab->buff;
-    uintptr_t obj = free * (1 << slab->obj_order) + slab->buff;
+    uint32_t idx = (obj - slab->buff) / cache->obj_size;
+    ASSERT(slab->obj_list[idx] != obj_removed);
+    slab->obj_list[idx] = obj_removed;
+#endif
 
     slab->free_objs--;
     
-    // move slab from partial to full list
+    // move slab from empty to partial list
+    if (slab->free_objs == slab->total_objs - 1) {
+        list_erase(&cache->empty, &slab->tag);
+        list_push_back(&cache->partial, &slab->tag);
+    }
+
+    // move slab from partial to full list, after the one above so that
+    // a slab of one obj goes empty -> partial -> full
     if (slab->free_objs == 0) {
         // remove slab from part
         list_erase(&cache->partial, &slab->tag);
@@ -173,12 +311,6 @@ static uintptr_t fetch_obj_from_slab(mem_cache_t* cache, slab_t *slab) {
         list_push_back(&cache->full, &slab->tag);
     }
 
-    // move slab from empty to partial list
-    if (slab->free_objs == slab->total_objs - 1) {
-        list_erase(&cache->empty, &slab->tag);
-        list_push_back(&cache->partial, &slab->tag);
-    }
-
     // must return an no empty obj
     return obj;
 }
@@ -186,24 +318,22 @@ static uintptr_t fetch_obj_from_slab(mem_cache_t* cache, slab_t *slab) {
 static void return_obj_to_slab(uintptr_t obj, slab_t *slab, mem_cache_t *slot) {
     ASSERT(obj && slab && slot);
     
+#if SLAB_DEBUG
     // compute obj index
     uint32_t obj_off = obj - slab->buff;
-    obj_off >>= slab->obj_order;
-    // obj_off /= slab->obj_size;
+    ASSERT(obj_off % slot->obj_size == 0);
+    obj_off /= slot->obj_size;
 
     ASSERT(slab->obj_list[obj_off] == obj_removed);
+    slab->obj_list[obj_off] = 0;
+#endif
 
-    slab->obj_list[obj_off] = slab->free;
+    obj_link(slot, obj) = slab->free;
 
-    slab->free = obj_off;
+    slab->free = obj;
 
     slab->free_objs++;
-
-    // from partial list to empty list
-    if (slab->free_objs == slab->total_objs) {
-        list_erase(&slot->partial, &slab->tag);
-        list_push_back(&slot->empty, &slab->tag);
-    }
+    slot->inuse--;
 
     // from full list to partial list
     if (slab->free_objs == 1) {
@@ -211,24 +341,15 @@ static void return_obj_to_slab(uintptr_t obj, slab_t *slab, mem_cache_t *slot) {
         list_push_back(&slot->partial, &slab->tag);
     }
 
-    try_free_empty_slabs(slot, NORMAL_FREE);
-
+    // from partial list to empty list
+    if (slab->free_objs == slab->total_objs) {
+        list_erase(&slot->partial, &slab->tag);
+        list_push_back(&slot->empty, &slab->tag);
+    }
 }
 
 
-uintptr_t slab_alloc(uint32_t n) {
-    if (n == 0)
-        return 0;
-
-    if (!is_pow_of_2(n))
-        n = next_pow_of_2(n);
-    
-    if (n < slab_obj_min_size)
-        n = slab_obj_min_size;
-    
-    uint32_t index = size2index(n) - slab_min_shift;
-    mem_cache_t *slot = mcached + index;
-
+static void *cache_alloc(mem_cache_t *slot) {
     slab_t *slab;
 
 retry:
@@ -240,16 +361,41 @@ retry:
         slab = tag2slab(slot->empty.head.next);
 
     else {
-        if (fill_empty_slot(index) == 0)
+        if (fill_empty_slot(slot) == 0)
             goto retry;
         else
             goto failed;
     }
 
-    return fetch_obj_from_slab(slot, slab);
+    slot->nr_alloc++;
+    slot->inuse++;
+    return (void*)fetch_obj_from_slab(slot, slab);
 
 failed:
-    return 0;
+    slot->nr_fail++;
+    return NULL;
+}
+
+
+// size class of a kmalloc request, n in (0, slab_obj_max_size]
+static uint32_t kmalloc_index(uint32_t n) {
+    if (n <= small_index_max)
+        return small_index[(n - 1) >> 3];
+
+    // 2^(k-1) < n <= 2^k, class 2^k or 3*2^(k-2) below it
+    uint32_t k = bsr(n - 1) + 1;
+    uint32_t index = (k - slab_min_shift) << 1;
+
+    if (n <= (3 << (k - 2)))
+        --index;
+    return index;
+}
+
+uintptr_t slab_alloc(uint32_t n) {
+    if (n == 0 || n > slab_obj_max_size)
+        return 0;
+
+    return (uintptr_t)cache_alloc(mcached + kmalloc_index(n));
 }
 
 
@@ -260,45 +406,129 @@ void slab_free(uintptr_t addr) {
 
     page_t *page = (page_t*)kvaddr2page(addr);
     slab_t *slab = page->slab;
-    
-    uint32_t index = slab->obj_order - slab_min_shift;
-
-    mem_cache_t *slot = mcached + index;
 
     ASSERT(page_slab(page));
     ASSERT(slab->free_objs < slab->total_objs);
 
-    return_obj_to_slab(addr, slab, slot);    
+    return_obj_to_slab(addr, slab, slab->cache);    
+}
+
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, 
+                                    uint32_t align, void (*ctor)(void *)) {
+    kmem_cache_t *cache;
+    if (size == 0)
+        return NULL;
+
+    if ((cache = (kmem_cache_t*)slab_alloc(sizeof(kmem_cache_t))) == NULL)
+        return NULL;
+
+    cache_init(cache, name, size, align, ctor, 0);
+
+    // object larger than the biggest slab
+    if (cache->slab_objs == 0) {
+        warn("kmem cache %s: obj size %d too large.\n", name, size);
+        list_erase(&cache_list, &cache->cache_tag);
+        slab_free((uintptr_t)cache);
+        return NULL;
+    }
+    return cache;
 }
 
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    ASSERT(cache);
+    ASSERT(list_empty(&cache->full) && list_empty(&cache->partial));
+
+    try_free_empty_slabs(cache, FORCE_FREE);
+    list_erase(&cache_list, &cache->cache_tag);
+    slab_free((uintptr_t)cache);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    ASSERT(cache);
+    return cache_alloc(cache);
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj)
+        return;
+
+    page_t *page = kvaddr2page((uintptr_t)obj);
+    slab_t *slab = page->slab;
+
+    ASSERT(page_slab(page) && slab->cache == cache);
+    ASSERT(slab->free_objs < slab->total_objs);
+
+    return_obj_to_slab((uintptr_t)obj, slab, cache);
+}
+
+
+// objs of each size class held by off-slab slab_t
+static void off_slab_usage(uint32_t *used) {
+    for (int i=0; i<num_cached; ++i)
+        used[i] = 0;
+
+    for (int i=0; i<num_cached; ++i) {
+        mem_cache_t *slot = mcached + i;
+        if (!(slot->flag & CACHE_OFF_SLAB))
+            continue;
+        used[kmalloc_index(slab_t_len(slot->slab_objs))] += 
+                slot->full.len + slot->partial.len + slot->empty.len;
+    }
+}
 
 static void test_slab(void) {
     // basic alloc and free
     // slab analyse
     /*
-    obj sizes <= 256, slab_t in slab's head;
-    sizeof(slab_t) == 32b, so we list num objs in one slab
+    obj sizes < 512, slab_t in slab's head;
+    free objs are linked through themselves, sizeof(slab_t) == 28b,
+    header is rounded up to the obj alignment (lowest set bit of size)
   -------------------------------
-    size    | objs  | alignobjs | header size
-    16      | 256   | 203       | 840
-    32      | 128   | 112       | 476
-    64      | 64    | 59        | 264
-    128     | 32    | 30        | 148
-    256     | 32    | 31        | 152
-    512     | 32    | 32        | 156   -> 256
-    1024    | 16    | 16        | 92    -> 128
-    2048    | 8     | 8         | 64    -> 64
-    4096    | 4     | 4         | 44    -> 64
-    8192    | 4     | 4         | 44    -> 64
+    size    | pages | objs      | waste
+    16      | 1     | 254       | 0
+    24      | 1     | 169       | 8
+    32      | 1     | 127       | 0
+    48      | 1     | 84        | 32
+    64      | 1     | 63        | 0
+    96      | 1     | 42        | 32
+    128     | 1     | 31        | 0
+    192     | 1     | 21        | 0
+    256     | 2     | 31        | 0
+    384     | 2     | 21        | 0
+    512     | 4     | 32        | 0     off slab from here
+    768     | 4     | 21        | 256
+    1024    | 4     | 16        | 0
+    1536    | 4     | 10        | 1024
+    2048    | 4     | 8         | 0
+    3072    | 8     | 10        | 2048
+    4096    | 4     | 4         | 0
+    6144    | 8     | 5         | 2048
+    8192    | 8     | 4         | 0
   --------------------------------
+    SLAB_DEBUG 另有每个obj 4b 的状态数组, 与原先的 obj_list 相同
     先判断空间obj数量
 */
-    uint32_t objs[] = {203, 112, 59, 30, 31, 32, 16, 8, 4, 4};
-    uint32_t ac_objs[] = {0, 0, 3, 1, 1, 0, 0, 0, 0, 0};
+#if SLAB_DEBUG
+    uint32_t objs[] = {203, 145, 113, 78, 59, 40, 30, 20, 31, 21, 
+                        32, 21, 16, 10, 8, 10, 4, 5, 4};
+#else
+    uint32_t objs[] = {254, 169, 127, 84, 63, 42, 31, 21, 31, 21, 
+                        32, 21, 16, 10, 8, 10, 4, 5, 4};
+#endif
+    uint32_t ac_objs[num_cached];
     uintptr_t obj_ptr[num_cached];
 
+    // size -> class, smallest class holding the request
+    ASSERT(kmalloc_index(1) == 0 && kmalloc_index(17) == 1);
+    ASSERT(kmalloc_index(192) == 7 && kmalloc_index(193) == 8);
+    ASSERT(kmalloc_index(260) == 9 && kmalloc_index(385) == 10);
+    ASSERT(kmalloc_index(6145) == 18 && kmalloc_index(8192) == 18);
+    for (int i=0; i<num_cached; ++i)
+        ASSERT(kmalloc_index(slab_sizes[i]) == i);
+
     for (int i=0; i<num_cached; ++i) {
-        obj_ptr[i] = slab_alloc(slab_obj_min_size << i);
+        obj_ptr[i] = slab_alloc(slab_sizes[i]);
         // print_str_int("slab_alloc:", obj_ptr[i]);
     }
 
@@ -309,6 +539,7 @@ static void test_slab(void) {
         ASSERT(slab->total_objs == objs[i]);
     }
 
+    off_slab_usage(ac_objs);
     for (int i=0; i<num_cached; ++i) {
         slab_t *slab = kvaddr2page(obj_ptr[i])->slab;
         slab_free(obj_ptr[i]);
@@ -317,57 +548,169 @@ static void test_slab(void) {
 
     for (int j=0; j<num_cached; ++j) {
         for (int i=0; i<num_cached; ++i)
-            obj_ptr[i] = slab_alloc(slab_obj_min_size << j);
+            obj_ptr[i] = slab_alloc(slab_sizes[j]);
         for (int i=num_cached-1; i>=0; --i)
             slab_free(obj_ptr[i]);
     }
     
     for (int i=0; i<num_cached; ++i) {
-        obj_ptr[i] = slab_alloc(slab_obj_min_size << i);
+        obj_ptr[i] = slab_alloc(slab_sizes[i]);
         slab_free(obj_ptr[i]);
     }
 
-    ac_objs[2] = 8;
+    off_slab_usage(ac_objs);
     for (int i=0; i<num_cached; ++i) {
         slab_t *slab = kvaddr2page(obj_ptr[i])->slab;
         // print_str_int("slab->free_objs:", slab->free_objs);
-
-        if (slab->obj_order >= 6 && slab->obj_order <= 8) {
-            ASSERT(ac_objs[i] + slab->free_objs == slab->total_objs);
-        }
-        else {
-            ASSERT(slab->free_objs == slab->total_objs);
-        }
+        ASSERT(ac_objs[i] + slab->free_objs == slab->total_objs);
     }
 }
 
 
+static int ctor_calls;
+
+static void test_ctor(void *obj) {
+    *(uint32_t*)obj = 0x5a5a5a5a;
+    ++ctor_calls;
+}
+
+static void test_kmem_cache(void) {
+    kmem_cache_t *cache = kmem_cache_create("test", 28, 0, test_ctor);
+    ASSERT(cache && cache->obj_size == 32 && cache->link_off == 28);
+
+    uint32_t *obj = kmem_cache_alloc(cache);
+    ASSERT(obj && *obj == 0x5a5a5a5a);
+    ASSERT(ctor_calls == cache->slab_objs);
+
+    slab_stat_t st;
+    kmem_cache_stat(cache, &st);
+    ASSERT(st.inuse == 1 && st.nr_alloc == 1 && st.nr_partial == 1);
+    ASSERT(st.nr_full == 0 && st.nr_empty == 0);
+
+    // constructed state survives free and realloc, no second ctor pass
+    *obj = 0xa5a5a5a5;
+    kmem_cache_free(cache, obj);
+    ASSERT(kmem_cache_alloc(cache) == obj && *obj == 0xa5a5a5a5);
+    ASSERT(ctor_calls == cache->slab_objs);
+
+    kmem_cache_free(cache, obj);
+    kmem_cache_destroy(cache);
+}
+
+
+static void test_slab_color(void) {
+    // 1 page of 33 objs, 108b left (100b with SLAB_DEBUG), 2 colors
+    kmem_cache_t *cache = kmem_cache_create("color", 120, 0, NULL);
+    uint32_t n = cache->slab_objs;
+    uint32_t first = ROUNDUP(slab_t_len(n), cache->align);
+    ASSERT(cache->colors == 2);
+
+    uintptr_t objs[n + 1];
+    for (int i=0; i<=n; ++i)
+        objs[i] = (uintptr_t)kmem_cache_alloc(cache);
+
+    // first obj of the second slab is one cache line further
+    ASSERT((objs[0] & (PAGE_SIZE - 1)) == first);
+    ASSERT((objs[n] & (PAGE_SIZE - 1)) == first + cache_line_size);
+
+    for (int i=0; i<=n; ++i)
+        kmem_cache_free(cache, (void*)objs[i]);
+    kmem_cache_destroy(cache);
+}
+
+static void test_slab_reclaim(void) {
+    mem_cache_t *slot = mcached + kmalloc_index(64);
+    uint32_t n = (slot->empty_high + 1) * slot->slab_objs;
+    uintptr_t *objs = (uintptr_t*)slab_alloc(n * sizeof(uintptr_t));
+    ASSERT(objs);
+
+    for (uint32_t i=0; i<n; ++i)
+        objs[i] = slab_alloc(64);
+
+    // free path keeps every empty slab
+    for (uint32_t i=0; i<n; ++i)
+        slab_free(objs[i]);
+    ASSERT(slot->empty.len > slot->empty_high);
+
+    slab_reclaim();
+    ASSERT(slot->empty.len == slot->empty_low);
+
+    // memory pressure drains the rest
+    while (slab_try_release_cache())
+        ;
+    ASSERT(list_empty(&slot->empty));
+
+    slab_free((uintptr_t)objs);
+}
+
+
 void slab_init(void) {
     // set all mcached list empty
-    mem_cache_t *cache;
+    list_init(&cache_list);
     for (int i=0; i<num_cached; ++i) {
-        cache = mcached + i;
-
-        list_init(&cache->empty);
-        list_init(&cache->full);
-        list_init(&cache->partial);
-        
-        cache->obj_order = slab_min_shift + i;
+        // natural alignment, the largest power of two dividing size
+        uint32_t size = slab_sizes[i];
+        cache_init(mcached + i, slab_names[i], size, size & -size, NULL, 
+                                                            slab_pages[i]);
     }
 
     // test slab
     test_slab();
+    test_kmem_cache();
+    test_slab_color();
+    test_slab_reclaim();
+}
+
+
+void kmem_cache_stat(kmem_cache_t *cache, slab_stat_t *st) {
+    st->name = cache->name;
+    st->obj_size = cache->obj_size;
+    st->slab_pages = cache->slab_pages;
+    st->slab_objs = cache->slab_objs;
+    st->nr_full = cache->full.len;
+    st->nr_partial = cache->partial.len;
+    st->nr_empty = cache->empty.len;
+    st->inuse = cache->inuse;
+    st->nr_alloc = cache->nr_alloc;
+    st->nr_fail = cache->nr_fail;
+}
+
+int slab_stat(int index, slab_stat_t *st) {
+    list_elem_t *elem = cache_list.head.next;
+    for (; index > 0 && elem != &cache_list.tail; --index)
+        elem = elem->next;
+
+    if (index < 0 || elem == &cache_list.tail)
+        return -1;
+
+    kmem_cache_stat(tag2cache(elem), st);
+    return 0;
 }
 
 
-inline void slab_try_release_cache(void) {
-    for (uint32_t i=0; i<num_cached; ++i) {
-        try_free_empty_slabs(mcached + i, SOFT_FREE); 
+// called from idle with irq off, never from the free path
+void slab_reclaim(void) {
+    list_elem_t *elem;
+    for (elem = cache_list.head.next; elem != &cache_list.tail; 
+                                                        elem = elem->next) {
+        try_free_empty_slabs(tag2cache(elem), NORMAL_FREE); 
+    }
+}
+
+uint32_t slab_try_release_cache(void) {
+    list_elem_t *elem;
+    uint32_t pages = 0;
+    for (elem = cache_list.head.next; elem != &cache_list.tail; 
+                                                        elem = elem->next) {
+        pages += try_free_empty_slabs(tag2cache(elem), SOFT_FREE); 
     }
+    return pages;
 }
 
 inline void slab_release_cache(void) {
-    for (uint32_t i=0; i<num_cached; ++i) {
-        try_free_empty_slabs(mcached + i, FORCE_FREE); 
+    list_elem_t *elem;
+    for (elem = cache_list.head.next; elem != &cache_list.tail; 
+                                                        elem = elem->next) {
+        try_free_empty_slabs(tag2cache(elem), FORCE_FREE); 
     }
 }
@@ -5,47 +5,110 @@
 #include <types.h>
 
 
-// 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192
+// 16, 24, 32, 48, 64, 96, ..., 4096, 6144, 8192
+// each power of two and 1.5 times of it
 #define slab_min_shift      4 
-#define num_cached          10
+#define slab_max_shift      13
+#define num_cached          19
 #define slab_obj_min_size   (1 << slab_min_shift)
+#define slab_obj_max_size   (1 << slab_max_shift)
 
-#define slab_t_in_slab_index (8 - slab_min_shift)
+// 1: keep a per-object state array in slab_t to catch double free
+#define SLAB_DEBUG  0
 
-#define slab_max_shift  (slab_min_shift + num_cached - 1)
+struct mem_cache;
 
+// free objs are linked through a word inside themselves, see link_off
 typedef struct slab {
-    uint32_t    free;
-    uint32_t    obj_order;
+    uintptr_t   free;           // first free obj, 0 if none
     uint32_t    total_objs;
     uint32_t    free_objs;
+    struct mem_cache    *cache;
     list_elem_t tag;
     uintptr_t   buff;
-    uint32_t    obj_list[1];
+#if SLAB_DEBUG
+    uint32_t    obj_list[1];    // obj_removed if the obj is handed out
+#endif
 } slab_t;
 
 
+// slab_t of the cache lives outside of the slab pages
+#define CACHE_OFF_SLAB  0x1
+
 typedef struct mem_cache {
-    uint32_t    obj_order;
+    const char  *name;
+    uint32_t    obj_size;       // object stride, a multiple of align
+    uint32_t    link_off;       // free link word offset in obj
+    uint32_t    align;
+    uint32_t    slab_pages;
+    uint32_t    slab_objs;
+    uint32_t    flag;
+    void        (*ctor)(void *);
+    uint32_t    colors;         // first obj offsets a slab can take
+    uint32_t    color_off;      // offset step, cache line or align
+    uint32_t    color_next;     // color of the next new slab
+    uint32_t    empty_high;     // reclaim when more empty slabs than this
+    uint32_t    empty_low;      // and keep this many
+    uint32_t    inuse;          // objs handed out
+    uint32_t    nr_alloc;
+    uint32_t    nr_fail;
     list_t      full;
     list_t      empty;
     list_t      partial; 
+    list_elem_t cache_tag;      // in the list of all caches
 } mem_cache_t;
 
+typedef mem_cache_t kmem_cache_t;
+
+// snapshot of a cache
+typedef struct slab_stat {
+    const char  *name;
+    uint32_t    obj_size;
+    uint32_t    slab_pages;
+    uint32_t    slab_objs;
+    uint32_t    nr_full;
+    uint32_t    nr_partial;
+    uint32_t    nr_empty;
+    uint32_t    inuse;
+    uint32_t    nr_alloc;
+    uint32_t    nr_fail;
+} slab_stat_t;
+
 
 #define tag2slab(addr) (elem2entry(slab_t, tag, addr))
 
+#define tag2cache(addr) (elem2entry(mem_cache_t, cache_tag, addr))
+
 void slab_init(void);
 
 uintptr_t slab_alloc(uint32_t n);
 
 void slab_free(uintptr_t addr);
 
-// try to release empty cache, do NOT call this group func easily
-// try release will keep at least half of the empty slab
-void slab_try_release_cache(void);
+// named cache of fixed size objects, ctor runs once per object when its
+// slab is created, objects keep the constructed state across frees
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, 
+                                    uint32_t align, void (*ctor)(void *));
+
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+void kmem_cache_stat(kmem_cache_t *cache, slab_stat_t *st);
+
+// stat of the index-th cache, kmalloc classes first, -1 past the last
+int slab_stat(int index, slab_stat_t *st);
+
+// trim caches above their high watermark, run from the idle loop
+void slab_reclaim(void);
+
+// memory pressure hook, release half of the empty slabs of every cache,
+// return pages given back to buddy
+uint32_t slab_try_release_cache(void);
 
 // release all the empty slab, actually, should never call it.
 void slab_release_cache(void);
 
-#endif
\ No newline at end of file
+#endif
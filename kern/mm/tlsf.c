@@ -0,0 +1,303 @@
+#include <tlsf.h>
+#include <x86.h>
+#include <list.h>
+#include <pmm.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_FREE          0x1
+#define BLOCK_PREV_FREE     0x2
+
+// only size is overhead, prev_phys belongs to the previous block
+#define block_overhead      sizeof(size_t)
+#define block_start_offset  (offset(tlsf_block_t, size) + sizeof(size_t))
+
+// a free block must hold next_free and prev_free, and the prev_phys
+// of the next block
+#define block_size_min      (sizeof(tlsf_block_t) - sizeof(tlsf_block_t*))
+#define block_size_max      ((size_t)1 << TLSF_FL_MAX)
+
+#define block_size(b)       ((b)->size & ~(BLOCK_FREE | BLOCK_PREV_FREE))
+#define block_is_free(b)    ((b)->size & BLOCK_FREE)
+#define block_is_prev_free(b)   ((b)->size & BLOCK_PREV_FREE)
+
+#define block_to_ptr(b)     ((void*)((uintptr_t)(b) + block_start_offset))
+#define ptr_to_block(p)     ((tlsf_block_t*)((uintptr_t)(p) - block_start_offset))
+
+#define offset_to_block(p, off) ((tlsf_block_t*)((uintptr_t)(p) + (off)))
+
+
+inline static void block_set_size(tlsf_block_t *b, size_t size) {
+    b->size = size | (b->size & (BLOCK_FREE | BLOCK_PREV_FREE));
+}
+
+inline static tlsf_block_t *block_next(tlsf_block_t *b) {
+    return offset_to_block(block_to_ptr(b), block_size(b) - block_overhead);
+}
+
+inline static tlsf_block_t *block_link_next(tlsf_block_t *b) {
+    tlsf_block_t *next = block_next(b);
+    next->prev_phys = b;
+    return next;
+}
+
+inline static void block_mark_as_free(tlsf_block_t *b) {
+    tlsf_block_t *next = block_link_next(b);
+    next->size |= BLOCK_PREV_FREE;
+    b->size |= BLOCK_FREE;
+}
+
+inline static void block_mark_as_used(tlsf_block_t *b) {
+    tlsf_block_t *next = block_next(b);
+    next->size &= ~BLOCK_PREV_FREE;
+    b->size &= ~BLOCK_FREE;
+}
+
+
+// fl, sl of the list size belongs to
+inline static void mapping_insert(size_t size, int *fl, int *sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+    }
+    else {
+        int f = bsr(size);
+        *sl = (size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = f - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+// round size up to the next list, every block there is big enough
+inline static void mapping_search(size_t size, int *fl, int *sl) {
+    if (size >= TLSF_SMALL_BLOCK)
+        size += (1 << (bsr(size) - TLSF_SL_LOG2)) - 1;
+    mapping_insert(size, fl, sl);
+}
+
+static tlsf_block_t *search_suitable_block(tlsf_t *t, int *fl, int *sl) {
+    uint32_t sl_map = t->sl_bitmap[*fl] & (~0U << *sl);
+
+    if (!sl_map) {
+        // first non empty fl above
+        uint32_t fl_map = *fl + 1 < 32 ? t->fl_bitmap & (~0U << (*fl + 1)) : 0;
+        if (!fl_map)
+            return NULL;
+
+        *fl = bsf(fl_map);
+        sl_map = t->sl_bitmap[*fl];
+    }
+
+    *sl = bsf(sl_map);
+    return t->blocks[*fl][*sl];
+}
+
+static void remove_free_block(tlsf_t *t, tlsf_block_t *b, int fl, int sl) {
+    tlsf_block_t *prev = b->prev_free;
+    tlsf_block_t *next = b->next_free;
+    next->prev_free = prev;
+    prev->next_free = next;
+
+    if (t->blocks[fl][sl] == b) {
+        t->blocks[fl][sl] = next;
+        if (next == &t->block_null) {
+            t->sl_bitmap[fl] &= ~(1U << sl);
+            if (!t->sl_bitmap[fl])
+                t->fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+static void insert_free_block(tlsf_t *t, tlsf_block_t *b, int fl, int sl) {
+    tlsf_block_t *cur = t->blocks[fl][sl];
+    b->next_free = cur;
+    b->prev_free = &t->block_null;
+    cur->prev_free = b;
+
+    t->blocks[fl][sl] = b;
+    t->fl_bitmap |= 1U << fl;
+    t->sl_bitmap[fl] |= 1U << sl;
+}
+
+inline static void block_remove(tlsf_t *t, tlsf_block_t *b) {
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+    remove_free_block(t, b, fl, sl);
+}
+
+inline static void block_insert(tlsf_t *t, tlsf_block_t *b) {
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+    insert_free_block(t, b, fl, sl);
+}
+
+
+// cut b to size, the rest becomes a free block
+static void block_trim_free(tlsf_t *t, tlsf_block_t *b, size_t size) {
+    if (block_size(b) < sizeof(tlsf_block_t) + size)
+        return;
+
+    tlsf_block_t *rest = offset_to_block(block_to_ptr(b), size - block_overhead);
+    rest->size = 0;
+    block_set_size(rest, block_size(b) - (size + block_overhead));
+    block_set_size(b, size);
+
+    block_mark_as_free(rest);
+    block_link_next(b);
+    // b is still free here, block_mark_as_used clears the bit
+    rest->size |= BLOCK_PREV_FREE;
+    block_insert(t, rest);
+}
+
+// prev takes b, b must not be in any list
+inline static tlsf_block_t *block_absorb(tlsf_block_t *prev, tlsf_block_t *b) {
+    prev->size += block_size(b) + block_overhead;
+    block_link_next(prev);
+    return prev;
+}
+
+
+tlsf_t *tlsf_create(void *mem, size_t bytes) {
+    uintptr_t st = ROUNDUP((uintptr_t)mem, TLSF_ALIGN);
+    uintptr_t ed = ROUNDDOWN((uintptr_t)mem + bytes, TLSF_ALIGN);
+    tlsf_t *t = (tlsf_t*)st;
+
+    // control, then the pool: first block size word and the end sentinel
+    uintptr_t pool = ROUNDUP(st + sizeof(tlsf_t), TLSF_ALIGN);
+    if (ed < pool + 2 * block_overhead + block_size_min)
+        return NULL;
+
+    size_t pool_bytes = ed - pool - 2 * block_overhead;
+    if (pool_bytes >= block_size_max)
+        pool_bytes = block_size_max - TLSF_ALIGN;
+
+    memset(t, 0, sizeof(tlsf_t));
+    t->block_null.next_free = t->block_null.prev_free = &t->block_null;
+    for (int i=0; i<TLSF_FL_COUNT; ++i)
+        for (int j=0; j<TLSF_SL_COUNT; ++j)
+            t->blocks[i][j] = &t->block_null;
+
+    // prev_phys of the first block overlaps the control tail, never used
+    tlsf_block_t *b = offset_to_block(pool, -(int)block_overhead);
+    b->size = pool_bytes | BLOCK_FREE;
+    block_insert(t, b);
+
+    // zero sized used sentinel, stops merge at the end
+    tlsf_block_t *tail = block_link_next(b);
+    tail->size = BLOCK_PREV_FREE;
+
+    t->size = pool_bytes + block_overhead;
+    return t;
+}
+
+void *tlsf_malloc(tlsf_t *t, size_t size) {
+    int fl, sl;
+    tlsf_block_t *b;
+
+    if (size == 0 || size >= block_size_max)
+        goto failed;
+
+    size = ROUNDUP(size, TLSF_ALIGN);
+    if (size < block_size_min)
+        size = block_size_min;
+
+    mapping_search(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT || (b = search_suitable_block(t, &fl, &sl)) == NULL)
+        goto failed;
+
+    remove_free_block(t, b, fl, sl);
+    block_trim_free(t, b, size);
+    block_mark_as_used(b);
+
+    t->used += block_size(b) + block_overhead;
+    if (t->used > t->peak)
+        t->peak = t->used;
+    t->nr_alloc++;
+    return block_to_ptr(b);
+
+failed:
+    t->nr_fail++;
+    return NULL;
+}
+
+void tlsf_free(tlsf_t *t, void *ptr) {
+    if (!ptr)
+        return;
+
+    tlsf_block_t *b = ptr_to_block(ptr);
+    ASSERT(!block_is_free(b));
+
+    t->used -= block_size(b) + block_overhead;
+    block_mark_as_free(b);
+
+    if (block_is_prev_free(b)) {
+        tlsf_block_t *prev = b->prev_phys;
+        block_remove(t, prev);
+        b = block_absorb(prev, b);
+    }
+
+    tlsf_block_t *next = block_next(b);
+    if (block_is_free(next)) {
+        block_remove(t, next);
+        b = block_absorb(b, next);
+    }
+
+    block_insert(t, b);
+}
+
+size_t tlsf_block_size(void *ptr) {
+    return block_size(ptr_to_block(ptr));
+}
+
+
+void check_tlsf(void) {
+    // 64 pages from buddy, freed at the end
+    const size_t pages = 64;
+    page_t *page = kalloc_pages(pages);
+    ASSERT(page);
+
+    tlsf_t *t = tlsf_create((void*)page2kvaddr(page), pages * PGSIZE);
+    ASSERT(t && t->fl_bitmap && t->used == 0);
+    size_t total = t->size;
+
+    // size classes
+    int fl, sl;
+    mapping_insert(TLSF_SMALL_BLOCK - 1, &fl, &sl);
+    ASSERT(fl == 0 && sl == TLSF_SL_COUNT - 1);
+    mapping_insert(TLSF_SMALL_BLOCK, &fl, &sl);
+    ASSERT(fl == 1 && sl == 0);
+    mapping_search(TLSF_SMALL_BLOCK + 1, &fl, &sl);
+    ASSERT(fl == 1 && sl == 1);
+
+    // alloc, write, free in mixed order
+    void *p[32];
+    for (int i=0; i<32; ++i) {
+        size_t n = 1 + i * 97;
+        p[i] = tlsf_malloc(t, n);
+        ASSERT(p[i] && ((uintptr_t)p[i] & (TLSF_ALIGN - 1)) == 0);
+        ASSERT(tlsf_block_size(p[i]) >= n);
+        memset(p[i], i, n);
+    }
+    for (int i=0; i<32; ++i) {
+        size_t n = 1 + i * 97;
+        ASSERT(((uint8_t*)p[i])[n - 1] == (uint8_t)i);
+    }
+    for (int i=0; i<32; i += 2)
+        tlsf_free(t, p[i]);
+    for (int i=31; i>0; i -= 2)
+        tlsf_free(t, p[i]);
+
+    // everything merged back into one block
+    ASSERT(t->used == 0 && t->peak > 0);
+    ASSERT(is_pow_of_2(t->fl_bitmap));
+    mapping_insert(total - block_overhead, &fl, &sl);
+    ASSERT(t->sl_bitmap[fl] == 1U << sl);
+    ASSERT(block_size(t->blocks[fl][sl]) == total - block_overhead);
+
+    ASSERT(tlsf_malloc(t, total) == NULL && t->nr_fail == 1);
+    ASSERT((p[0] = tlsf_malloc(t, total / 2)) != NULL);
+    tlsf_free(t, p[0]);
+    ASSERT(t->used == 0);
+
+    kfree_pages(page, pages);
+}
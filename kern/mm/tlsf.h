@@ -0,0 +1,60 @@
+#ifndef __L_TLSF_H
+#define __L_TLSF_H
+
+#include <types.h>
+
+/*
+TLSF (Two-Level Segregated Fit) 分配器，管理一块预先分配好的连续内存
+一级按 2 的幂分段，二级把每段等分成 16 份，每份一条空闲链表，两级各有位图
+分配和释放都只做常数次 bsf/bsr 和链表操作，不循环，不调用 buddy，
+最坏执行时间有界，碎片有上界，给需要 WCET 的分区或内核子系统使用
+
+块头只有 size 一个字是开销，prev_phys 放在前一块的末尾，仅在前一块空闲时有效
+i386 下按 4 字节对齐
+*/
+
+#define TLSF_ALIGN_LOG2     2
+#define TLSF_ALIGN          (1 << TLSF_ALIGN_LOG2)
+
+#define TLSF_SL_LOG2        4
+#define TLSF_SL_COUNT       (1 << TLSF_SL_LOG2)
+
+// blocks below 2^TLSF_FL_SHIFT are all in fl 0, split evenly by sl
+#define TLSF_FL_SHIFT       (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_FL_MAX         30
+#define TLSF_FL_COUNT       (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+#define TLSF_SMALL_BLOCK    (1 << TLSF_FL_SHIFT)
+
+typedef struct tlsf_block {
+    struct tlsf_block *prev_phys;   // last word of the previous block
+    size_t size;                    // bit 0 free, bit 1 previous free
+    struct tlsf_block *next_free;   // payload starts here when used
+    struct tlsf_block *prev_free;
+} tlsf_block_t;
+
+typedef struct tlsf {
+    tlsf_block_t    block_null;     // end of every free list
+    uint32_t        fl_bitmap;
+    uint32_t        sl_bitmap[TLSF_FL_COUNT];
+    tlsf_block_t    *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    size_t          size;           // bytes of the pool, headers included
+    size_t          used;           // bytes of used blocks, headers included
+    size_t          peak;
+    uint32_t        nr_alloc;
+    uint32_t        nr_fail;
+} tlsf_t;
+
+// build a tlsf over [mem, mem + bytes), control struct at the head
+tlsf_t *tlsf_create(void *mem, size_t bytes);
+
+void *tlsf_malloc(tlsf_t *tlsf, size_t size);
+
+void tlsf_free(tlsf_t *tlsf, void *ptr);
+
+// usable bytes of an allocated block
+size_t tlsf_block_size(void *ptr);
+
+void check_tlsf(void);
+
+#endif
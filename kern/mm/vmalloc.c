@@ -0,0 +1,247 @@
+#include <vmalloc.h>
+#include <pmm.h>
+#include <mmu.h>
+#include <slab.h>
+#include <bitmap.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// one bit per page of the vmalloc area
+static uint8_t  vmap_bmap_buff[VMALLOC_PAGES >> 3];
+static bitmap_t vmap_bmap;
+
+// areas in use
+static list_t   vmap_list;
+
+static kmem_cache_t *vmap_cache;
+
+static void check_vmalloc(void);
+
+#define vmap_index(addr)    (((addr) - VMALLOC_START) >> PAGE_SHIFT)
+
+void vmalloc_init(void) {
+    vmap_bmap.len = sizeof(vmap_bmap_buff);
+    vmap_bmap.buff = vmap_bmap_buff;
+    bitmap_init(&vmap_bmap);
+    list_init(&vmap_list);
+
+    if ((vmap_cache = kmem_cache_create("vmap", sizeof(vmap_t), 0, NULL))
+                                                                    == NULL)
+        panic("vmap cache create failed.\n");
+
+    // page tables of the area live in boot_pgdir from now on, so every
+    // page dir copied from it sees the same mappings
+    for (uintptr_t va = VMALLOC_START; va < VMALLOC_END; va += PTSIZE) {
+        if (get_pte(boot_pgdir, va, 1) == NULL)
+            panic("vmalloc page table alloc failed.\n");
+    }
+
+    check_vmalloc();
+}
+
+
+// kernel data, never run
+#define VMAP_PERM   (PTE_W | PTE_G | pte_nx)
+
+// an area of npages and the guard page after it, nothing mapped yet
+static vmap_t *vmap_area_alloc(size_t npages) {
+    vmap_t *vm;
+    int index;
+
+    if ((vm = kmem_cache_alloc(vmap_cache)) == NULL)
+        return NULL;
+
+    // keep an unmapped guard page after each area
+    if ((index = bitmap_scan(&vmap_bmap, npages + 1)) < 0) {
+        kmem_cache_free(vmap_cache, vm);
+        return NULL;
+    }
+
+    vm->addr = VMALLOC_START + (index << PAGE_SHIFT);
+    vm->npages = npages;
+    vm->size = npages * PGSIZE;
+    vm->pages = NULL;
+    vm->page_list = NULL;
+    return vm;
+}
+
+static void vmap_area_free(vmap_t *vm) {
+    uint32_t index = vmap_index(vm->addr);
+    for (size_t i=0; i<vm->npages + 1; ++i)
+        bitmap_remove(&vmap_bmap, index + i);
+
+    kmem_cache_free(vmap_cache, vm);
+}
+
+void *vmalloc(size_t size) {
+    vmap_t *vm;
+    page_t *page;
+
+    if (size == 0)
+        return NULL;
+
+    size_t npages = ROUNDUP(size, PGSIZE) >> PAGE_SHIFT;
+
+    if ((vm = vmap_area_alloc(npages)) == NULL)
+        return NULL;
+    vm->size = size;
+
+    for (size_t i=0; i<npages; ++i) {
+        // only mapped here, compaction may move it
+        if ((page = alloc_movable_page(ZONE_KERN)) == NULL) {
+            pgdir_unmap_range(boot_pgdir, vm->addr, i);
+            goto page_failed;
+        }
+        if (pgdir_map_page(boot_pgdir, vm->addr + i * PGSIZE, page,
+                                                        VMAP_PERM) != 0) {
+            kfree_pages(page, 1);
+            pgdir_unmap_range(boot_pgdir, vm->addr, i);
+            goto page_failed;
+        }
+    }
+
+    list_push_back(&vmap_list, &vm->tag);
+    return (void*)vm->addr;
+
+page_failed:
+    vmap_area_free(vm);
+    return NULL;
+}
+
+void *vmap(page_t *page, size_t npages) {
+    vmap_t *vm;
+
+    if (page == NULL || npages == 0)
+        return NULL;
+    if ((vm = vmap_area_alloc(npages)) == NULL)
+        return NULL;
+
+    // the caller's reference keeps the pages when the mappings go
+    for (size_t i=0; i<npages; ++i)
+        page[i].ref_count++;
+
+    if (pgdir_map_range(boot_pgdir, vm->addr, page, npages, VMAP_PERM) != 0) {
+        for (size_t i=0; i<npages; ++i)
+            page[i].ref_count--;
+        vmap_area_free(vm);
+        return NULL;
+    }
+
+    vm->pages = page;
+    list_push_back(&vmap_list, &vm->tag);
+    return (void*)vm->addr;
+}
+
+void *vmap_pages(page_t **pages, size_t npages) {
+    vmap_t *vm;
+
+    if (pages == NULL || npages == 0)
+        return NULL;
+    if ((vm = vmap_area_alloc(npages)) == NULL)
+        return NULL;
+
+    for (size_t i=0; i<npages; ++i)
+        pages[i]->ref_count++;
+
+    if (pgdir_map_pages(boot_pgdir, vm->addr, pages, npages, VMAP_PERM) != 0) {
+        for (size_t i=0; i<npages; ++i)
+            pages[i]->ref_count--;
+        vmap_area_free(vm);
+        return NULL;
+    }
+
+    vm->page_list = pages;
+    list_push_back(&vmap_list, &vm->tag);
+    return (void*)vm->addr;
+}
+
+page_t *vmalloc2page(const void *addr) {
+    pte_t *ptep = get_pte(boot_pgdir, (uintptr_t)addr, 0);
+    if (ptep == NULL || !(*ptep & PTE_P))
+        return NULL;
+    return kpaddr2page(PTE_ADDR(*ptep));
+}
+
+void vfree(void *addr) {
+    list_elem_t *elem;
+    vmap_t *vm = NULL;
+
+    if (!addr)
+        return;
+
+    for (elem = vmap_list.head.next; elem != &vmap_list.tail;
+                                                        elem = elem->next) {
+        if (tag2vmap(elem)->addr == (uintptr_t)addr) {
+            vm = tag2vmap(elem);
+            break;
+        }
+    }
+
+    if (!vm) {
+        warn("vfree bad addr: %x.\n", addr);
+        return;
+    }
+
+    list_erase(&vmap_list, &vm->tag);
+    pgdir_unmap_range(boot_pgdir, vm->addr, vm->npages);
+
+    // pages of vmap go back to the caller's only reference
+    for (size_t i=0; vm->pages && i<vm->npages; ++i)
+        vm->pages[i].ref_count--;
+    for (size_t i=0; vm->page_list && i<vm->npages; ++i)
+        vm->page_list[i]->ref_count--;
+
+    vmap_area_free(vm);
+}
+
+
+static void check_vmalloc(void) {
+    // bigger than any single buddy block we would like to take
+    size_t n = 64 * PGSIZE + 1;
+    uint8_t *p1 = vmalloc(n);
+    uint8_t *p2 = vmalloc(PGSIZE);
+
+    assert(p1 && p2);
+    assert((uintptr_t)p1 == VMALLOC_START);
+    // 65 pages and a guard page
+    assert((uintptr_t)p2 == VMALLOC_START + 66 * PGSIZE);
+
+    memset(p1, 0x5a, n);
+    memset(p2, 0xa5, PGSIZE);
+    assert(p1[n - 1] == 0x5a && p2[0] == 0xa5);
+
+    pte_t *ptep = get_pte(boot_pgdir, (uintptr_t)p1 + 65 * PGSIZE, 0);
+    assert(ptep && !(*ptep & PTE_P));
+    assert(!pte_nx || (*get_pte(boot_pgdir, (uintptr_t)p1, 0) & PTE_NX));
+
+    vfree(p1);
+    ptep = get_pte(boot_pgdir, (uintptr_t)p1, 0);
+    assert(ptep && !(*ptep & PTE_P));
+
+    // freed range is found again
+    assert(vmalloc(PGSIZE) == p1);
+    vfree(p1);
+    vfree(p2);
+    assert(list_empty(&vmap_list));
+
+    // vmap maps pages the caller keeps
+    page_t *page = kalloc_pages(2);
+    assert(page);
+    page[0].ref_count = page[1].ref_count = 0;
+    uint8_t *v = vmap(page, 2);
+    assert(v && vmalloc2page(v + PGSIZE) == page + 1);
+    v[PGSIZE] = 0x3c;
+    assert(*(uint8_t*)page2kvaddr(page + 1) == 0x3c);
+    vfree(v);
+    assert(page[1].ref_count == 0 && vmalloc2page(v) == NULL);
+
+    // vmap_pages lines up pages from anywhere, here in reverse
+    page_t *list[2] = {page + 1, page};
+    v = vmap_pages(list, 2);
+    assert(v && vmalloc2page(v) == page + 1 && vmalloc2page(v + PGSIZE) == page);
+    assert(v[0] == 0x3c);
+    vfree(v);
+    assert(page[0].ref_count == 0 && page[1].ref_count == 0);
+    kfree_pages(page, 2);
+}
@@ -0,0 +1,46 @@
+#ifndef __L_VMALLOC_H
+#define __L_VMALLOC_H
+
+#include <types.h>
+#include <list.h>
+#include <memlayout.h>
+
+/*
+vmalloc 区: 虚拟地址连续, 物理页逐页分配, 不占用 buddy 的大块连续内存
+区间 [VMALLOC_START, VMALLOC_END) 的页表在启动时全部建好, 
+所有页目录共享这些内核页表, 分配时只需写 pte
+*/
+
+#define VMALLOC_PAGES   ((VMALLOC_END - VMALLOC_START) >> 12)
+
+struct page;
+
+typedef struct vmap {
+    uintptr_t   addr;
+    size_t      npages;     // mapped pages, a guard page follows
+    size_t      size;       // bytes asked
+    struct page *pages;     // pages of vmap, the caller's; NULL for vmalloc
+    struct page **page_list;    // pages of vmap_pages, the caller's array
+    list_elem_t tag;
+} vmap_t;
+
+#define tag2vmap(addr)  (elem2entry(vmap_t, tag, addr))
+
+void vmalloc_init(void);
+
+void *vmalloc(size_t size);
+
+void vfree(void *addr);
+
+// map npages pages from page in the vmalloc area, high ones too, vfree
+// takes the mapping down and leaves the pages to the caller
+void *vmap(struct page *page, size_t npages);
+
+// map the npages pages of the array one after another, they need not be
+// contiguous; the array must live until vfree
+void *vmap_pages(struct page **pages, size_t npages);
+
+// page mapped at addr of the vmalloc area, NULL if none
+struct page *vmalloc2page(const void *addr);
+
+#endif
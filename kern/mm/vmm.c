@@ -3,6 +3,12 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <mmu.h>
+#include <x86.h>
+#include <error.h>
+#include <ppool.h>
+#include <slab.h>
+#include <buddy.h>
 
 
 #define min(x, y)   ((x) < (y) ? (x) : (y))
@@ -10,10 +16,29 @@
 #define max(x, y)   ((x) > (y) ? (x) : (y))
 
 
+static kmem_cache_t *vma_cache;
+static kmem_cache_t *mm_cache;
+
+
+static bool vma_less(rb_node_t *a, rb_node_t *b) {
+    return rb2vma(a)->ed_addr < rb2vma(b)->ed_addr;
+}
+
+inline static void insert_vma(vmm_t *mm, vma_t *vma, vma_t *before) {
+    if (before)
+        list_insert_before(&mm->vma_set, &before->list_tag, &vma->list_tag);
+    else
+        list_push_back(&mm->vma_set, &vma->list_tag);
+    rb_insert(&mm->vma_tree, &vma->rb_tag, vma_less);
+}
+
 inline static void remove_vma(vmm_t *mm, vma_t *vma) {
     ASSERT(vma->mm == mm);
 
     list_erase(&mm->vma_set, &vma->list_tag);
+    rb_erase(&mm->vma_tree, &vma->rb_tag);
+    if (mm->mmap_cache == vma)
+        mm->mmap_cache = NULL;
 }
 
 static int vma_merge_check(vma_t *vma1, vma_t *vma2) {
@@ -38,14 +63,20 @@ static void merge_vma(vma_t *keep, vma_t *free) {
 
     if (free->mm) {
         if (!keep->mm) {
+            // keep takes the slot of free, merging only grows it over
+            // its neighbours, so the tree order still holds
+            vmm_t *mm = free->mm;
             list_replace(&free->list_tag, &keep->list_tag);
-            keep->mm = free->mm;
+            rb_replace(&mm->vma_tree, &free->rb_tag, &keep->rb_tag);
+            if (mm->mmap_cache == free)
+                mm->mmap_cache = keep;
+            keep->mm = mm;
         } else {
             remove_vma(free->mm, free);
         }
     }
     
-    kfree(free);
+    kmem_cache_free(vma_cache, free);
 }
 
 static int try_merge_vma_range(vma_t *nvma, vma_t *st_vma, vma_t *ed_vma) {
@@ -85,12 +116,8 @@ static int try_merge_vma_range(vma_t *nvma, vma_t *st_vma, vma_t *ed_vma) {
 }
 
 
-static bool find_vma_func(list_elem_t *le, void *arg) {
-    ASSERT(le && arg);
- 
-    vma_t *cvma = le2vma(le);
-
-    return cvma->ed_addr >= (uintptr_t)arg;
+static bool find_vma_func(rb_node_t *node, void *arg) {
+    return rb2vma(node)->ed_addr >= (uintptr_t)arg;
 }
 
 
@@ -98,7 +125,7 @@ vma_t *vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t flags) {
     ASSERT(vm_start < vm_end && flags); 
 
     vma_t *vma;
-    if ((vma = kmalloc(sizeof(vma_t))) == NULL) {
+    if ((vma = kmem_cache_alloc(vma_cache)) == NULL) {
         return NULL;
     }
 
@@ -106,6 +133,7 @@ vma_t *vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t flags) {
     vma->ed_addr = ROUNDUP(vm_end, PAGE_SIZE);
 
     vma->flag = flags;
+    vma->nr_fault = 0;
     vma->mm = NULL;
     list_elem_init(&vma->list_tag);
 
@@ -113,34 +141,52 @@ vma_t *vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t flags) {
 }
 
 
-// find vma, vma is sorted by ed addr
+// find the first vma whose ed addr is not below addr
 vma_t *find_vma(vmm_t *mm, uintptr_t addr) {
     ASSERT(mm);
 
-    list_elem_t *le = NULL;
-    if ((le = list_traversal(&mm->vma_set, find_vma_func, (void*)addr))  == NULL) {
-        return NULL;
+    // faults come in runs on the same vma, the cached one is the answer
+    // when it holds addr and the vma before it ends below addr
+    vma_t *vma = mm->mmap_cache;
+    if (vma && vma->st_addr <= addr && addr < vma->ed_addr) {
+        list_elem_t *prev = vma->list_tag.prev;
+        if (prev == &mm->vma_set.head || le2vma(prev)->ed_addr < addr)
+            return vma;
     }
 
-    return le2vma(le);
+    rb_node_t *node = rb_lower_bound(&mm->vma_tree, find_vma_func,
+                                                            (void*)addr);
+    if (node == NULL)
+        return NULL;
+
+    vma = rb2vma(node);
+    mm->mmap_cache = vma;
+    return vma;
 }
 
 
+static uint32_t vma_dirty_slots(vma_t *vma);
+static int snap_dirty_reserve(mm_snap_t *snap, uint32_t more);
+
 int vma_add(vmm_t *mm, vma_t *vma) {
     ASSERT(mm && vma);
 
+    // a vma after the image gets its dirty log slots here, not on a fault
+    if (mm->snap && snap_dirty_reserve(mm->snap, vma_dirty_slots(vma)) != 0)
+        return E_NO_MEM;
+
     vma_t *next = find_vma(mm, vma->ed_addr);
     vma_t *prev = find_vma(mm, vma->st_addr);
 
     // last vma in mm, just push_back 
     if (!prev && !next) {
-        list_push_back(&mm->vma_set, &vma->list_tag);
+        insert_vma(mm, vma, NULL);
         goto done;
     }
 
-    // prev == null, the new is last vma
+    // next == null, prev is the last vma and touches the new one
     if (prev && !next) {
-        if (vma_merge_check(vma, next) != 0)
+        if (vma_merge_check(vma, prev) != 0)
             return -1;
         merge_vma(vma, prev);
         goto done;
@@ -150,7 +196,7 @@ retry:
     // prev == next && not NULL, 
     if (prev == next && prev) {
         if (vma_merge_check(vma, next) != 0) {
-            list_insert_before(&mm->vma_set, &prev->list_tag, &vma->list_tag);
+            insert_vma(mm, vma, prev);
             goto done;
         }
         merge_vma(vma, prev);
@@ -178,13 +224,22 @@ done:
 }
 
 
+static void vma_unmap(vmm_t *mm, vma_t *vma);
+
 vmm_t *mm_create(void) {
-    vmm_t *vmm = kmalloc(sizeof(vmm_t));
+    vmm_t *vmm = kmem_cache_alloc(mm_cache);
     if (!vmm)
         return NULL;
     
     list_init(&vmm->vma_set);
-    vmm->pgdir = NULL;
+    rb_tree_init(&vmm->vma_tree);
+    vmm->mmap_cache = NULL;
+    vmm->snap = NULL;
+    if ((vmm->pgdir = pgdir_create()) == NULL) {
+        kmem_cache_free(mm_cache, vmm);
+        return NULL;
+    }
+    vmm->pool = NULL;
     vmm->ref_count = 0;
     vmm->brk = vmm->brk_start = 0;
     return vmm;
@@ -198,33 +253,536 @@ void mm_destroy(vmm_t *mm) {
     vma_t *vma;
     list_elem_t *elem;
 
-    for (elem = list_front(&mm->vma_set); elem != &mm->vma_set.tail; ) {
+    mm_snapshot_drop(mm);
+    for (elem = mm->vma_set.head.next; elem != &mm->vma_set.tail; ) {
         list_erase(&mm->vma_set, elem);
         vma = le2vma(elem);
         elem = elem->next;
-        kfree(vma);
+        vma_unmap(mm, vma);
+        kmem_cache_free(vma_cache, vma);
+    }
+    pgdir_destroy(mm->pgdir);
+    kmem_cache_free(mm_cache, mm);
+}
+
+// load the page dir of mm, boot_pgdir when mm is NULL
+void mm_switch(vmm_t *mm) {
+    uintptr_t cr3 = mm ? pgdir_cr3(mm->pgdir) : boot_cr3;
+    if (rcr3() != cr3)
+        lcr3(cr3);
+}
+
+
+// first page of a stack vma is the guard page, never back it
+inline static uintptr_t vma_map_start(vma_t *vma) {
+    if (vma->flag & VM_STACK)
+        return vma->st_addr + PAGE_SIZE;
+    return vma->st_addr;
+}
+
+inline static pte_t vma_pte_perm(vma_t *vma) {
+    pte_t perm = PG_US_U;
+    if (vma->flag & VM_WRITE) {
+        perm |= PG_RW_W;
+    }
+    // data and stack never run
+    if (!(vma->flag & VM_EXEC)) {
+        perm |= pte_nx;
+    }
+    return perm;
+}
+
+// pages of vma a fault may add to the dirty log, each at most once:
+// VM_PREFAULT vmas do not fault, shared pages are all mapped at attach
+static uint32_t vma_dirty_slots(vma_t *vma) {
+    if (vma->flag & (VM_SHARED | VM_PREFAULT))
+        return 0;
+    return (vma->ed_addr - vma->st_addr) >> PAGE_SHIFT;
+}
+
+// make room for more entries in the dirty log, never on the fault path
+static int snap_dirty_reserve(mm_snap_t *snap, uint32_t more) {
+    if (more == 0)
+        return 0;
+
+    uint32_t cap = snap->dirty_cap + more;
+    uintptr_t *dirty = kmalloc(cap * sizeof(uintptr_t));
+    if (dirty == NULL)
+        return E_NO_MEM;
+
+    memcpy(dirty, snap->dirty, snap->nr_dirty * sizeof(uintptr_t));
+    kfree(snap->dirty);
+    snap->dirty = dirty;
+    snap->dirty_cap = cap;
+    return 0;
+}
+
+// sized in mm_snapshot, the fault path only appends
+inline static bool snap_dirty_full(mm_snap_t *snap) {
+    return snap != NULL && snap->nr_dirty >= snap->dirty_cap;
+}
+
+// back addr with a zeroed page from the partition pool or the user zone
+static int mm_insert_page(vmm_t *mm, uintptr_t addr, pte_t perm) {
+    page_t *page;
+    int ret;
+
+    // a page the initial image does not have, rollback drops it
+    if (snap_dirty_full(mm->snap))
+        return E_NO_MEM;
+
+    if (mm->pool) {
+        if ((page = ppool_alloc_pages(mm->pool, 1)) == NULL)
+            return E_NO_MEM;
+        page_clear(page);
+    }
+    else {
+        if ((page = alloc_zeroed_page(ZONE_USER)) == NULL)
+            return E_NO_MEM;
+        // only mapped here, compaction may move it
+        page_set_movable(page);
+        page->rmap.pgdir = NULL;
+    }
+
+    page->ref_count = 0;
+    if ((ret = pgdir_map_page(mm->pgdir, addr, page, perm)) != 0)
+        kfree_pages(page, 1);
+
+    if (ret == 0 && mm->snap)
+        mm->snap->dirty[mm->snap->nr_dirty++] = addr;
+    return ret;
+}
+
+// write to a read only page of a writable vma, the page is shared with
+// the initial image: copy it unless nobody else holds it
+static int mm_cow_page(vmm_t *mm, vma_t *vma, uintptr_t addr) {
+    pte_t perm = vma_pte_perm(vma);
+    pte_t *ptep;
+    page_t *page, *npage;
+
+    if ((mm->pgdir[PDX(addr)] & PTE_PS) ||
+            (ptep = get_pte(mm->pgdir, addr, 0)) == NULL || !(*ptep & PTE_P))
+        return E_FAULT;
+
+    if (snap_dirty_full(mm->snap))
+        return E_NO_MEM;
+
+    page = kpaddr2page(PTE_ADDR(*ptep));
+    if (page->ref_count == 1) {
+        pgdir_protect_range(mm->pgdir, addr, 1, perm);
+        goto out;
     }
-    kfree(mm);
+
+    if (mm->pool)
+        npage = ppool_alloc_pages(mm->pool, 1);
+    else
+        npage = alloc_movable_page(ZONE_USER);
+    if (npage == NULL)
+        return E_NO_MEM;
+
+    page_copy(npage, page);
+    npage->ref_count = 0;
+    pgdir_replace_page(mm->pgdir, addr, npage, perm);
+
+out:
+    if (mm->snap)
+        mm->snap->dirty[mm->snap->nr_dirty++] = addr;
+    return 0;
+}
+
+inline static bool vma_page_mapped(vmm_t *mm, uintptr_t addr) {
+    if (mm->pgdir[PDX(addr)] & PTE_PS)
+        return 1;
+
+    pte_t *ptep = get_pte(mm->pgdir, addr, 0);
+    return ptep != NULL && (*ptep & PTE_P);
+}
+
+// map the 2M span holding addr with one pde, when the span lies in a
+// VM_HUGE vma and has nothing mapped yet. a plain pool is one buddy
+// block of the 2M aligned user zone, so its 2M blocks are aligned too;
+// a colored pool only has single pages. once the image is taken new
+// pages are tracked one by one, they stay small
+static int vma_map_huge(vmm_t *mm, vma_t *vma, uintptr_t addr) {
+    uintptr_t span = ROUNDDOWN(addr, PTSIZE);
+    page_t *page;
+    int ret;
+
+    if (!(vma->flag & VM_HUGE) || mm->snap != NULL)
+        return E_INVAL;
+    if (mm->pool && mm->pool->colors)
+        return E_INVAL;
+    if (span < vma_map_start(vma) || span + PTSIZE > vma->ed_addr ||
+                                        (mm->pgdir[PDX(span)] & PTE_P))
+        return E_INVAL;
+
+    if (mm->pool)
+        page = ppool_alloc_pages(mm->pool, NPTEENTRY);
+    else
+        page = alloc_pages(ZONE_USER, NPTEENTRY);
+    if (page == NULL)
+        return E_NO_MEM;
+
+    if ((ret = pgdir_map_huge(mm->pgdir, span, page, vma_pte_perm(vma))) != 0)
+        kfree_pages(page, NPTEENTRY);
+    return ret;
+}
+
+// back every page of [st, ed) that is not mapped yet
+static int vma_map_range(vmm_t *mm, vma_t *vma, uintptr_t st, uintptr_t ed) {
+    pte_t perm = vma_pte_perm(vma);
+
+    for (uintptr_t addr = st; addr < ed; addr += PAGE_SIZE) {
+        if (vma_page_mapped(mm, addr))
+            continue;
+        if (vma_map_huge(mm, vma, addr) == 0)
+            continue;
+        if (mm_insert_page(mm, addr, perm) != 0)
+            return E_NO_MEM;
+    }
+    return 0;
+}
+
+static void vma_unmap(vmm_t *mm, vma_t *vma) {
+    pgdir_unmap_range(mm->pgdir, vma->st_addr,
+                        (vma->ed_addr - vma->st_addr) >> PAGE_SHIFT);
+}
+
+// map the aligned window around addr, best effort, addr itself is mapped
+static void vma_fault_around(vmm_t *mm, vma_t *vma, uintptr_t addr) {
+    const uint32_t win = FAULT_AROUND_PAGES * PAGE_SIZE;
+    uintptr_t st = max(ROUNDDOWN(addr, win), vma_map_start(vma));
+    uintptr_t ed = min(ROUNDDOWN(addr, win) + win, vma->ed_addr);
+
+    vma_map_range(mm, vma, st, ed);
+}
+
+// back the whole vma now, so later touches never fault
+int vma_prefault(vmm_t *mm, vma_t *vma) {
+    ASSERT(mm && vma);
+
+    // page tables of the range in one batch
+    uintptr_t st = vma_map_start(vma);
+    if (pt_reserve((ROUNDUP(vma->ed_addr, PTSIZE) - ROUNDDOWN(st, PTSIZE))
+                                                        / PTSIZE) != 0)
+        return E_NO_MEM;
+    return vma_map_range(mm, vma, st, vma->ed_addr);
+}
+
+// prefault every VM_PREFAULT vma of mm, call it at partition init
+int mm_prefault(vmm_t *mm) {
+    ASSERT(mm);
+
+    list_elem_t *elem;
+    vma_t *vma;
+    int ret;
+
+    for (elem = mm->vma_set.head.next; elem != &mm->vma_set.tail; 
+                                                        elem = elem->next) {
+        vma = le2vma(elem);
+        if (!(vma->flag & VM_PREFAULT))
+            continue;
+        if ((ret = vma_prefault(mm, vma)) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+
+// map the npages of pages at va as one VM_SHARED vma, flags VM_WRITE or 0,
+// the pages stay the caller's, the mapping only holds references
+int mm_map_shared(vmm_t *mm, uintptr_t va, struct page **pages,
+                                            size_t npages, uint32_t flags) {
+    uintptr_t ed = va + npages * PAGE_SIZE;
+    vma_t *vma;
+    int ret;
+
+    ASSERT(mm && pages);
+    if ((va & (PAGE_SIZE - 1)) || npages == 0 || ed <= va || ed > KERNBASE)
+        return E_INVAL;
+
+    // nothing there yet, a shared range never merges over private pages
+    if ((vma = find_vma(mm, va + 1)) != NULL && vma->st_addr < ed)
+        return E_INVAL;
+
+    flags = (flags & VM_WRITE) | VM_READ | VM_SHARED;
+    if ((vma = vma_create(va, ed, flags)) == NULL)
+        return E_NO_MEM;
+
+    if ((ret = pgdir_map_pages(mm->pgdir, va, pages, npages,
+                                            vma_pte_perm(vma))) != 0) {
+        kmem_cache_free(vma_cache, vma);
+        return ret;
+    }
+
+    if (vma_add(mm, vma) != 0) {
+        pgdir_unmap_range(mm->pgdir, va, npages);
+        kmem_cache_free(vma_cache, vma);
+        return E_INVAL;
+    }
+    return 0;
+}
+
+/*
+ * 初始镜像: 分区初始化完成后, 可写 vma 里已映射的页各加一个引用留作镜像,
+ * 映射改成只读, 之后的写走 copy on write. 写过的页和新映射的页记在
+ * dirty 里, 回滚只处理这些页: 解除映射, 镜像里有的再只读映射回来,
+ * 所以回滚的开销只和写过的页数有关. dirty 拍镜像时按可能缺页的页数
+ * 一次分好, 缺页时只追加, 不在缺页路径上分配内存.
+ * VM_PREFAULT 的 vma 在 NORMAL 里不能有缺页, 拍镜像时直接复制一份,
+ * 映射保持可写, 回滚时整段复制回去; 2M 页也这样处理, 不拆成小页
+ */
+
+#define VM_SNAP_MASK    (VM_WRITE | VM_SHARED | VM_PREFAULT)
+
+// mapped pages of the writable private vmas, fill sp when given. copy
+// picks the pages the image copies: those of VM_PREFAULT vmas and every
+// page under a 2M pde, else the small pages of the other vmas
+static uint32_t snap_collect(vmm_t *mm, struct snap_page *sp, bool copy) {
+    uint32_t n = 0;
+    list_elem_t *elem;
+
+    for (elem = mm->vma_set.head.next; elem != &mm->vma_set.tail;
+                                                        elem = elem->next) {
+        vma_t *vma = le2vma(elem);
+        uint32_t kind = vma->flag & VM_SNAP_MASK;
+        if (kind != VM_WRITE && kind != (VM_WRITE | VM_PREFAULT))
+            continue;
+
+        for (uintptr_t addr = vma->st_addr; addr < vma->ed_addr; ) {
+            pde_t pde = mm->pgdir[PDX(addr)];
+            if (!(pde & PTE_P)) {
+                addr = ROUNDDOWN(addr, PTSIZE) + PTSIZE;
+                continue;
+            }
+
+            // a 2M span lies whole in its vma
+            if (pde & PTE_PS) {
+                for (int i=0; copy && i<NPTEENTRY; ++i, ++n) {
+                    if (sp) {
+                        sp[n].va = addr + i * PAGE_SIZE;
+                        sp[n].page = kpaddr2page(PDE_ADDR(pde)) + i;
+                    }
+                }
+                addr += PTSIZE;
+                continue;
+            }
+
+            pte_t *ptep = get_pte(mm->pgdir, addr, 0);
+            if ((*ptep & PTE_P) && copy == !!(kind & VM_PREFAULT)) {
+                if (sp) {
+                    sp[n].va = addr;
+                    sp[n].page = kpaddr2page(PTE_ADDR(*ptep));
+                }
+                ++n;
+            }
+            addr += PAGE_SIZE;
+        }
+    }
+    return n;
+}
+
+// a private copy of every mapped page of the VM_PREFAULT vmas and 2M spans
+static int snap_copy(vmm_t *mm, mm_snap_t *snap) {
+    uint32_t n = snap_collect(mm, NULL, 1);
+    if (n == 0)
+        return 0;
+
+    if ((snap->copies = kmalloc(n * sizeof(struct snap_page))) == NULL)
+        return E_NO_MEM;
+    snap_collect(mm, snap->copies, 1);
+    snap->nr_copies = n;
+
+    for (uint32_t i=0; i<n; ++i) {
+        page_t *live = snap->copies[i].page, *page;
+        if (mm->pool)
+            page = ppool_alloc_pages(mm->pool, 1);
+        else
+            page = alloc_pages(ZONE_USER, 1);
+
+        snap->copies[i].page = page;
+        if (page == NULL) {
+            // the rest still point at live pages
+            for (uint32_t j=i+1; j<n; ++j)
+                snap->copies[j].page = NULL;
+            return E_NO_MEM;
+        }
+        page_copy(page, live);
+    }
+    return 0;
+}
+
+// small pages go read only, the 2M spans are copied and stay writable
+static void snap_protect(vmm_t *mm, vma_t *vma) {
+    uintptr_t st = vma->st_addr, ed;
+
+    if (!(vma->flag & VM_HUGE)) {
+        pgdir_protect_range(mm->pgdir, st,
+                        (vma->ed_addr - st) >> PAGE_SHIFT, PG_US_U);
+        return;
+    }
+
+    for (; st < vma->ed_addr; st = ed) {
+        ed = min(ROUNDDOWN(st, PTSIZE) + PTSIZE, vma->ed_addr);
+        if (!(mm->pgdir[PDX(st)] & PTE_PS))
+            pgdir_protect_range(mm->pgdir, st,
+                                (ed - st) >> PAGE_SHIFT, PG_US_U);
+    }
+}
+
+static struct snap_page *snap_find(mm_snap_t *snap, uintptr_t va) {
+    int l = 0, r = (int)snap->nr_pages - 1;
+
+    while (l <= r) {
+        int mid = (l + r) >> 1;
+        if (snap->pages[mid].va == va)
+            return snap->pages + mid;
+        if (snap->pages[mid].va < va)
+            l = mid + 1;
+        else
+            r = mid - 1;
+    }
+    return NULL;
+}
+
+int mm_snapshot(vmm_t *mm) {
+    mm_snap_t *snap;
+    ASSERT(mm);
+
+    if (mm->snap)
+        return E_INVAL;
+    if ((snap = kmalloc(sizeof(mm_snap_t))) == NULL)
+        return E_NO_MEM;
+
+    memset(snap, 0, sizeof(mm_snap_t));
+    mm->snap = snap;
+    if (snap_copy(mm, snap) != 0) {
+        mm_snapshot_drop(mm);
+        return E_NO_MEM;
+    }
+
+    uint32_t n = snap_collect(mm, NULL, 0);
+    if (n && (snap->pages = kmalloc(n * sizeof(struct snap_page))) == NULL) {
+        mm_snapshot_drop(mm);
+        return E_NO_MEM;
+    }
+    snap->nr_pages = snap_collect(mm, snap->pages, 0);
+
+    // a slot for every page a fault in NORMAL may add or copy
+    uint32_t slots = 0;
+    list_elem_t *elem;
+    for (elem = mm->vma_set.head.next; elem != &mm->vma_set.tail;
+                                                        elem = elem->next)
+        slots += vma_dirty_slots(le2vma(elem));
+    if (snap_dirty_reserve(snap, slots) != 0) {
+        mm_snapshot_drop(mm);
+        return E_NO_MEM;
+    }
+
+    // the image holds each page, it is no longer mapped only once
+    for (uint32_t i=0; i<snap->nr_pages; ++i) {
+        page_t *page = snap->pages[i].page;
+        page->ref_count++;
+        if (page_movable(page))
+            page->rmap.pgdir = NULL;
+    }
+
+    for (elem = mm->vma_set.head.next; elem != &mm->vma_set.tail;
+                                                        elem = elem->next) {
+        vma_t *vma = le2vma(elem);
+        if ((vma->flag & VM_SNAP_MASK) == VM_WRITE)
+            snap_protect(mm, vma);
+    }
+    return 0;
+}
+
+// on failure the mm is half restored, only a cold start is left
+int mm_rollback(vmm_t *mm) {
+    mm_snap_t *snap = mm->snap;
+    struct snap_page *sp;
+
+    if (snap == NULL)
+        return E_INVAL;
+
+    // the copies go first with one flush, the image pages are not
+    // present before and need none
+    pgdir_unmap_pages(mm->pgdir, snap->dirty, snap->nr_dirty);
+    for (uint32_t i=0; i<snap->nr_dirty; ++i) {
+        uintptr_t va = snap->dirty[i];
+        if ((sp = snap_find(snap, va)) == NULL)
+            continue;
+        // read only as in the image, NX as the vma says
+        pte_t perm = vma_pte_perm(find_vma(mm, va)) & ~(pte_t)PTE_W;
+        if (pgdir_map_page(mm->pgdir, va, sp->page, perm) != 0)
+            return E_NO_MEM;
+    }
+
+    snap->nr_dirty = 0;
+
+    for (uint32_t i=0; i<snap->nr_copies; ++i) {
+        sp = snap->copies + i;
+        pde_t pde = mm->pgdir[PDX(sp->va)];
+        if (pde & PTE_PS) {
+            page_copy(kpaddr2page(PDE_ADDR(pde)) + PTX(sp->va), sp->page);
+            continue;
+        }
+
+        pte_t *ptep = get_pte(mm->pgdir, sp->va, 0);
+        if (ptep == NULL || !(*ptep & PTE_P))
+            return E_FAULT;
+        page_copy(kpaddr2page(PTE_ADDR(*ptep)), sp->page);
+    }
+    return 0;
+}
+
+void mm_snapshot_drop(vmm_t *mm) {
+    mm_snap_t *snap = mm->snap;
+    if (snap == NULL)
+        return;
+
+    // pages still mapped read only become writable on the next write
+    for (uint32_t i=0; i<snap->nr_pages; ++i) {
+        page_t *page = snap->pages[i].page;
+        if (--page->ref_count == 0)
+            kfree_pages(page, 1);
+    }
+
+    // copies are the image's own, collected ones are still NULL
+    for (uint32_t i=0; i<snap->nr_copies; ++i) {
+        if (snap->copies[i].page)
+            kfree_pages(snap->copies[i].page, 1);
+    }
+
+    kfree(snap->copies);
+    kfree(snap->pages);
+    kfree(snap->dirty);
+    kfree(snap);
+    mm->snap = NULL;
 }
 
 
 int do_pgfault(vmm_t *mm, uint32_t error_code, uintptr_t addr) {
     // invalid param
     int ret = -1;
-    void *paddr = (void*)addr;
-    vma_t *vma = find_vma(mm, paddr);
-    if (vma == NULL || vma->st_addr > paddr) {
+    vma_t *vma = find_vma(mm, addr);
+    if (vma == NULL || vma->st_addr > addr) {
         goto failed;
     }
 
     // stack overflow
     ret = -2;
     if (vma->flag & VM_STACK) {
-        if (addr < (uintptr_t)(vma->st_addr) + PAGE_SIZE) {
+        if (addr < vma->st_addr + PAGE_SIZE) {
             goto failed;
         }
     }
 
+    // instruction fetch outside code, only reported with NX on
+    if ((error_code & 0x10) && !(vma->flag & VM_EXEC)) {
+        ret = -3;
+        goto failed;
+    }
+
     switch (error_code & 3) 
     {
     default:
@@ -247,17 +805,27 @@ int do_pgfault(vmm_t *mm, uint32_t error_code, uintptr_t addr) {
         } 
     }
 
-    uint32_t perm = PG_US_U;
-    if (vma->flag & VM_WRITE) {
-        perm |= PG_RW_W;
-    }
+    // shared pages are all mapped at attach, nothing to back here
+    if (vma->flag & VM_SHARED)
+        goto failed;
 
     addr = ROUNDDOWN(addr, PAGE_SIZE);
 
     // no memory
     ret = -4;
-//    if (pgdir_insert_page(addr, perm) != 0) 
-//        goto failed;
+    if (error_code & 1) {
+        // write to a present page, copy on write
+        if (mm_cow_page(mm, vma, addr) != 0)
+            goto failed;
+    }
+    else if (vma_map_huge(mm, vma, addr) != 0 &&
+                        mm_insert_page(mm, addr, vma_pte_perm(vma)) != 0)
+        goto failed;
+
+    vma->nr_fault++;
+
+    if (vma->flag & VM_FAULTAROUND)
+        vma_fault_around(mm, vma, addr);
 
     ret = 0;
 
@@ -293,6 +861,36 @@ static int check_vma_sorted(vmm_t *mm) {
 } 
 
 
+// tree in the same order as the list, lookups match a list walk
+static int check_vma_tree(vmm_t *mm, uintptr_t ed) {
+    list_elem_t *le = mm->vma_set.head.next;
+    rb_node_t *node;
+
+    if (mm->vma_tree.size != vma_num(mm))
+        return -1;
+
+    for (node = rb_first(&mm->vma_tree); node; node = rb_next(node)) {
+        if (rb2vma(node) != le2vma(le))
+            return -2;
+        le = le->next;
+    }
+
+    for (uintptr_t addr = 0; addr < ed; addr += PAGE_SIZE / 2) {
+        vma_t *vma = NULL;
+        for (le = mm->vma_set.head.next; le != &mm->vma_set.tail;
+                                                            le = le->next) {
+            if (le2vma(le)->ed_addr >= addr) {
+                vma = le2vma(le);
+                break;
+            }
+        }
+        // twice, the second one may come from the cache
+        if (find_vma(mm, addr) != vma || find_vma(mm, addr) != vma)
+            return -3;
+    }
+    return 0;
+}
+
 static void check_vmm_vma(void) {
     vmm_t *mm = mm_create();
     ASSERT(mm);
@@ -356,6 +954,26 @@ static void check_vmm_vma(void) {
     ASSERT(vma_num(mm) == size);
 
     ASSERT(check_vma_sorted(mm) == 0);
+    ASSERT(check_vma_tree(mm, base * (size + 1)) == 0);
+
+    // many small vmas with gaps, then fill every gap with one that merges
+    uintptr_t st = base * (size + 1);
+    for (int i=0; i<64; ++i) {
+        vma_t *tvma = vma_create(st + i * 3 * PAGE_SIZE,
+                                    st + i * 3 * PAGE_SIZE + PAGE_SIZE, flags);
+        ASSERT(tvma && vma_add(mm, tvma) == 0);
+    }
+    ASSERT(vma_num(mm) == size + 64);
+    ASSERT(check_vma_tree(mm, st + 64 * 3 * PAGE_SIZE) == 0);
+
+    for (int i=0; i<64; i += 2) {
+        vma_t *tvma = vma_create(st + i * 3 * PAGE_SIZE + PAGE_SIZE,
+                            st + (i + 1) * 3 * PAGE_SIZE + PAGE_SIZE, flags);
+        ASSERT(tvma && vma_add(mm, tvma) == 0);
+    }
+    ASSERT(vma_num(mm) == size + 32);
+    ASSERT(check_vma_sorted(mm) == 0);
+    ASSERT(check_vma_tree(mm, st + 64 * 3 * PAGE_SIZE) == 0);
 
     mm_destroy(mm);
 
@@ -369,6 +987,12 @@ static void check_pgfault(void) {
     check_mm = mm_create();
     ASSERT(check_mm);
 
+    // back the test from a partition pool
+    ppool_t *pool = ppool_create(0, 64, 0);
+    ASSERT(pool);
+    check_mm->pool = pool;
+    mm_switch(check_mm);
+
     uintptr_t user_base = 0x400000 * 2;
     uintptr_t staddr = user_base + 0x1000;
     uintptr_t edaddr = user_base + 0x1fff;
@@ -394,11 +1018,104 @@ static void check_pgfault(void) {
     for (int i=0; i<tnum; ++i) {
         ASSERT(t[i] == i);
     }
+
+    // the whole test ran inside one page, only the first touch faults
+    ASSERT(vma->nr_fault == 1);
+
+    // fault around: one fault maps the aligned window it falls in
+    staddr = user_base + 0x10000;
+    vma = vma_create(staddr, staddr + 2 * FAULT_AROUND_PAGES * PAGE_SIZE, 
+                                                VM_WRITE | VM_FAULTAROUND);
+    ASSERT(vma && vma_add(check_mm, vma) == 0);
+
+    for (int i=0; i<FAULT_AROUND_PAGES; ++i) {
+        t = (int*)(staddr + i * PAGE_SIZE);
+        *t = i;
+    }
+    ASSERT(vma->nr_fault == 1);
+
+    t = (int*)(staddr + FAULT_AROUND_PAGES * PAGE_SIZE);
+    *t = 0;
+    ASSERT(vma->nr_fault == 2);
+
+    // prefault: nothing faults after mm_prefault
+    staddr = user_base + 0x100000;
+    vma = vma_create(staddr, staddr + 4 * PAGE_SIZE, VM_WRITE | VM_PREFAULT);
+    ASSERT(vma && vma_add(check_mm, vma) == 0);
+    ASSERT(mm_prefault(check_mm) == 0);
+
+    for (int i=0; i<4; ++i) {
+        t = (int*)(staddr + i * PAGE_SIZE);
+        ASSERT(*t == 0);
+        *t = i;
+    }
+    ASSERT(vma->nr_fault == 0);
+    // data pages of a vma without VM_EXEC never run
+    ASSERT((*get_pte(check_mm->pgdir, staddr, 0) & PTE_NX) == pte_nx);
+
+    // the mappings never reach boot_pgdir
+    ASSERT(boot_pgdir[PDX(test_addr)] == 0);
+
+    // mm_destroy unmaps the pages, the page tables go with the last one,
+    // pgdir_destroy checks none is left
+    ASSERT(pool->used == 1 + 2 * FAULT_AROUND_PAGES + 4);
+    mm_destroy(check_mm);
+    check_mm = NULL;
+
+    ASSERT(pool->used == 0 && rcr3() == boot_cr3);
+    ppool_destroy(pool);
     
     cprintf("check pgfault pass.\n");
 }
 
+static void check_huge(void) {
+    buddy_stat_t st;
+    check_mm = mm_create();
+    ASSERT(check_mm);
+
+    // two whole 2M spans and a page that is not
+    uintptr_t base = 4 * PTSIZE;
+    vma_t *vma = vma_create(base, base + 2 * PTSIZE + PAGE_SIZE,
+                                                    VM_WRITE | VM_HUGE);
+    ASSERT(vma && vma_add(check_mm, vma) == 0);
+    mm_switch(check_mm);
+
+    // 2M only when the user zone has a block that large, PAE pdes
+    // always take them
+    bool huge = zone_stat(ZONE_USER, &st) == 0 && st.largest >= NPTEENTRY;
+    pde_t *pdep = check_mm->pgdir + PDX(base + PTSIZE);
+
+    int *t = (int*)(base + PTSIZE + 0x100);
+    *t = 1;
+    ASSERT(vma->nr_fault == 1);
+    ASSERT(!huge || (*pdep & PTE_PS));
+
+    // the far end of the span is backed by the same fault
+    t = (int*)(base + 2 * PTSIZE - sizeof(int));
+    ASSERT(*t == 0);
+    *t = 2;
+    ASSERT(vma->nr_fault == (huge ? 1 : 2));
+
+    // the tail falls back to a small page
+    t = (int*)(base + 2 * PTSIZE);
+    *t = 3;
+    ASSERT(!(check_mm->pgdir[PDX(base + 2 * PTSIZE)] & PTE_PS));
+    ASSERT(boot_pgdir[PDX(base + PTSIZE)] == 0);
+
+    mm_destroy(check_mm);
+    check_mm = NULL;
+
+    cprintf("check huge pass.\n");
+}
+
 void vmm_init(void) {
+    vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0, NULL);
+    mm_cache = kmem_cache_create("vmm", sizeof(vmm_t), 0, NULL);
+    if (!vma_cache || !mm_cache)
+        panic("vmm cache create failed.\n");
+
+    check_rbtree();
     check_vmm_vma();
-    //check_pgfault();
+    check_pgfault();
+    check_huge();
 }
\ No newline at end of file
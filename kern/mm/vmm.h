@@ -2,11 +2,39 @@
 #define __L_VMM_H
 
 #include <types.h>
+#include <mmu.h>
 #include <list.h>
+#include <rbtree.h>
 
+struct ppool;
+struct vma;
+struct page;
+
+// initial image of an mm: pages of writable vmas held read only, and
+// the pages written or mapped since, a rollback only touches those;
+// VM_PREFAULT vmas keep writable mappings and a private copy instead
+typedef struct mm_snap {
+    uint32_t    nr_pages;
+    struct snap_page {
+        uintptr_t   va;
+        struct page *page;
+    } *pages;               // sorted by va
+    uint32_t    nr_copies;
+    struct snap_page *copies;   // copies of the VM_PREFAULT and 2M pages
+    uintptr_t   *dirty;
+    uint32_t    nr_dirty;
+    uint32_t    dirty_cap;
+} mm_snap_t;
+
+// vmas are kept both in a list sorted by address and in a tree keyed
+// by end address, lookups go through the tree
 typedef struct vmm {
     list_t      vma_set;
-    uint32_t    *pgdir;
+    rb_tree_t   vma_tree;
+    struct vma  *mmap_cache;    // vma found by the last lookup
+    mm_snap_t   *snap;          // initial image, or NULL
+    pde_t       *pgdir;         // own page dir, kernel half shared
+    struct ppool    *pool;  // partition pool backing the pages, or NULL
     uint32_t    ref_count;
     uintptr_t   brk_start;
     uintptr_t   brk;
@@ -18,17 +46,28 @@ typedef struct vma
     uintptr_t   st_addr;
     uintptr_t   ed_addr;
     uint32_t    flag;
+    uint32_t    nr_fault;   // page faults served in this vma
     list_elem_t list_tag;
+    rb_node_t   rb_tag;
 } vma_t;
 
 #define vma_num(mm) ((mm)->vma_set.len)    
 
-#define le2vma(le)  elem2entry(vma_t, list_tag, le)
+#define le2vma(le)  (elem2entry(vma_t, list_tag, le))
+
+#define rb2vma(rb)  (elem2entry(vma_t, rb_tag, rb))
 
 #define     VM_READ     0x00000001
 #define     VM_WRITE    0x00000002
 #define     VM_EXEC     0x00000004
 #define     VM_STACK    0x00000008
+#define     VM_PREFAULT 0x00000010  // back the whole vma at partition init
+#define     VM_FAULTAROUND  0x00000020  // map neighbour pages on each fault
+#define     VM_HUGE     0x00000040  // map whole 2M spans with one pde
+#define     VM_SHARED   0x00000080  // pages of a shared region, mapped at attach
+
+// pages mapped around a fault in VM_FAULTAROUND vma, aligned window
+#define FAULT_AROUND_PAGES  16
 
 
 vma_t *vma_create(uintptr_t vm_start, uintptr_t vm_end, uint32_t vm_flags);
@@ -43,6 +82,27 @@ vmm_t *mm_create(void);
 
 void mm_destroy(vmm_t *mm);
 
+void mm_switch(vmm_t *mm);
+
+int mm_map_shared(vmm_t *mm, uintptr_t va, struct page **pages,
+                                            size_t npages, uint32_t flags);
+
 int do_pgfault(vmm_t *mm, uint32_t error_code, uintptr_t addr);
 
+int vma_prefault(vmm_t *mm, vma_t *vma);
+
+int mm_prefault(vmm_t *mm);
+
+// take the current pages of writable vmas as the initial image,
+// writes after this copy on write, VM_PREFAULT vmas are copied now
+int mm_snapshot(vmm_t *mm);
+
+// put back the initial image, only the pages in the dirty log and
+// the copies of VM_PREFAULT vmas
+int mm_rollback(vmm_t *mm);
+
+void mm_snapshot_drop(vmm_t *mm);
+
+extern vmm_t *check_mm;
+
 #endif
\ No newline at end of file
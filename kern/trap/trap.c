@@ -10,6 +10,7 @@
 #include <kdebug.h>
 #include <string.h>
 #include <process.h>
+#include <vmm.h>
 
 #define TICK_NUM 100
 
@@ -145,6 +146,37 @@ print_regs(struct pushregs *regs) {
     cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+static inline void
+print_pgfault(struct trapframe *tf) {
+    /* error_code:
+     * bit 0 == 0 means no page found, 1 means protection fault
+     * bit 1 == 0 means read, 1 means write
+     * bit 2 == 0 means kernel, 1 means user
+     * bit 4 == 1 means instruction fetch, only with NX on
+     * */
+    cprintf("page fault at 0x%08x: %c/%c [%s].\n", rcr2(),
+            (tf->tf_err & 4) ? 'U' : 'K',
+            (tf->tf_err & 0x10) ? 'X' : (tf->tf_err & 2) ? 'W' : 'R',
+            (tf->tf_err & 1) ? "protection fault" : "no page found");
+}
+
+static int
+pgfault_handler(struct trapframe *tf) {
+    vmm_t *mm;
+    // vmm check runs before any task owns an mm
+    if (check_mm != NULL) {
+        mm = check_mm;
+    } else {
+        mm = current_thread->mm;
+    }
+
+    if (mm == NULL) {
+        print_pgfault(tf);
+        return -1;
+    }
+    return do_pgfault(mm, tf->tf_err, rcr2());
+}
+
 /* temporary trapframe or pointer to trapframe */
 struct trapframe switchk2u, *switchu2k;
 
@@ -152,8 +184,15 @@ struct trapframe switchk2u, *switchu2k;
 static void
 trap_dispatch(struct trapframe *tf) {
     char c;
+    int ret;
 
     switch (tf->tf_trapno) {
+    case T_PGFLT:
+        if ((ret = pgfault_handler(tf)) != 0) {
+            print_trapframe(tf);
+            panic("handle pgfault failed. ret=%d\n", ret);
+        }
+        break;
     case IRQ_OFFSET + IRQ_TIMER:
         /* LAB1 YOUR CODE : STEP 3 */
         /* handle the timer interrupt */
@@ -2,8 +2,9 @@
 #include <string.h>
 #include <stdio.h>
 
+// len is in bytes
 inline int bitmap_set(struct bitmap *map, uint32_t index) {
-    if (index >= map->len)
+    if (index >= (map->len << 3))
         return -1;
     uint8_t *char_addr = map->buff + (index >> 3);
     uint8_t mask = 0x1 << (index & 0x7);
@@ -12,7 +13,7 @@ inline int bitmap_set(struct bitmap *map, uint32_t index) {
 }
 
 inline int bitmap_remove(struct bitmap *map, uint32_t index) {
-    if (index >= map->len)
+    if (index >= (map->len << 3))
         return -1;
     uint8_t *char_addr = map->buff + (index >> 3);
     uint8_t mask = 0xff ^ (0x1 << (index & 0x7));
@@ -65,63 +66,46 @@ bit map scan 这个算法比较棘手，先整理出一个思路吧，最后有
 // }
 
 
+// find cnt continuous free bits from st, mark them used
 int bitmap_scan_partial(struct bitmap *map, uint32_t cnt, uint32_t st) {
-    uint8_t *end_buff;
+    uint32_t nbits = map->len << 3;
     uint32_t empty_count = 0;
-    uint32_t index = 0;
-
-    typedef struct map_byte {
-        uint8_t *byte;
-        uint8_t off;
-    } byte_t;
-
-    byte_t cur_byte, st_byte;
-    
-    st_byte.off = st & 7;
-    st_byte.byte = map->buff + (st >> 3);
-    cur_byte = st_byte;
-    end_buff = map->buff + map->len;
-
-    while (1) {
-        // byte full
-        if (*cur_byte.byte == 0xff) {
-            ++cur_byte.byte;
-            cur_byte.off = 0;
-            st_byte = cur_byte;
+    uint32_t index = st;
+
+    if (cnt == 0)
+        return BIT_SCAN_FAIL;
+
+    for (uint32_t i = st; i < nbits; ) {
+        uint8_t *byte = map->buff + (i >> 3);
+
+        // whole byte, used or free
+        if ((i & 7) == 0 && (*byte == 0xff || 
+                            (*byte == 0 && cnt - empty_count >= 8))) {
+            if (*byte == 0xff) {
+                empty_count = 0;
+            } else {
+                if (empty_count == 0)
+                    index = i;
+                empty_count += 8;
+            }
+            i += 8;
+        }
+        else if (BYTE_BIT(byte, (i & 7))) {
             empty_count = 0;
-            continue;
+            ++i;
         }
-
-        while (empty_count < cnt && cur_byte.byte < end_buff) {
-            if (!BYTE_BIT(cur_byte.byte, cur_byte.off)) {
-                ++empty_count;
-
-                if (empty_count == cnt) {
-                    goto found;
-                }
-                ++cur_byte.off;
-            } 
-            else {
-                ++cur_byte.off;
-                st_byte = cur_byte;
-            }
-
-            if (cur_byte.off== 8) {
-                cur_byte.off = 0;
-                ++cur_byte.byte;
-                st_byte = cur_byte;
-                break;
-            }
+        else {
+            if (empty_count++ == 0)
+                index = i;
+            ++i;
         }
 
-        if (cur_byte.byte >= end_buff) 
-            return BIT_SCAN_FAIL;
+        if (empty_count == cnt)
+            goto found;
     }
+    return BIT_SCAN_FAIL;
    
 found:
-    index = (uint32_t)(st_byte.byte - map->buff) << 3;
-    index += st_byte.off;
-
     for (int i=0; i<cnt; ++i) {
         bitmap_set(map, index + i);
     }
@@ -176,6 +160,16 @@ void check_bitmap(void) {
         BITMAP_ASSERT(rres[i] == i*2);
     }
 
+    // runs across bytes
+    bitmap_init(&map);
+    BITMAP_ASSERT(bitmap_scan(&map, 3) == 0);
+    BITMAP_ASSERT(bitmap_scan(&map, 20) == 3);
+    BITMAP_ASSERT(bitmap_scan(&map, 1) == 23);
+    bitmap_remove(&map, 1);
+    BITMAP_ASSERT(bitmap_scan(&map, 2) == 24);
+    BITMAP_ASSERT(bitmap_scan(&map, 1) == 1);
+    BITMAP_ASSERT(bitmap_scan(&map, 80 - 26) == 26);
+    BITMAP_ASSERT(bitmap_scan(&map, 1) == BIT_SCAN_FAIL);
 }
 
 #undef BITMAP_ASSERT
@@ -0,0 +1,355 @@
+#include <rbtree.h>
+#include <stdio.h>
+
+#define rb_is_red(n)    ((n) != NULL && (n)->color == RB_RED)
+#define rb_is_black(n)  ((n) == NULL || (n)->color == RB_BLACK)
+
+void rb_tree_init(rb_tree_t *tree) {
+    tree->root = NULL;
+    tree->size = 0;
+}
+
+// hang nnode where old hung under parent
+inline static void rb_change_child(rb_tree_t *tree, rb_node_t *old,
+                                    rb_node_t *nnode, rb_node_t *parent) {
+    if (parent == NULL)
+        tree->root = nnode;
+    else if (parent->left == old)
+        parent->left = nnode;
+    else
+        parent->right = nnode;
+}
+
+static void rb_rotate_left(rb_tree_t *tree, rb_node_t *x) {
+    rb_node_t *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    rb_change_child(tree, x, y, x->parent);
+
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_tree_t *tree, rb_node_t *x) {
+    rb_node_t *y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    rb_change_child(tree, x, y, x->parent);
+
+    y->right = x;
+    x->parent = y;
+}
+
+static void rb_insert_fixup(rb_tree_t *tree, rb_node_t *node) {
+    rb_node_t *parent, *gparent, *uncle;
+
+    while (rb_is_red(parent = node->parent)) {
+        gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+            if (rb_is_red(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(tree, gparent);
+        }
+        else {
+            uncle = gparent->left;
+            if (rb_is_red(uncle)) {
+                parent->color = uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(tree, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(tree, gparent);
+        }
+    }
+
+    tree->root->color = RB_BLACK;
+}
+
+// equal keys go right, after the ones already there
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_less_t less) {
+    rb_node_t **link = &tree->root, *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        link = less(node, parent) ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+    tree->size++;
+
+    rb_insert_fixup(tree, node);
+}
+
+// node took the place of a black node, it is one black short
+static void rb_erase_fixup(rb_tree_t *tree, rb_node_t *node,
+                                                    rb_node_t *parent) {
+    rb_node_t *sib;
+
+    while (node != tree->root && rb_is_black(node)) {
+        if (node == parent->left) {
+            sib = parent->right;
+            if (rb_is_red(sib)) {
+                sib->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(tree, parent);
+                sib = parent->right;
+            }
+            if (rb_is_black(sib->left) && rb_is_black(sib->right)) {
+                sib->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (rb_is_black(sib->right)) {
+                sib->left->color = RB_BLACK;
+                sib->color = RB_RED;
+                rb_rotate_right(tree, sib);
+                sib = parent->right;
+            }
+            sib->color = parent->color;
+            parent->color = RB_BLACK;
+            sib->right->color = RB_BLACK;
+            rb_rotate_left(tree, parent);
+            node = tree->root;
+        }
+        else {
+            sib = parent->left;
+            if (rb_is_red(sib)) {
+                sib->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(tree, parent);
+                sib = parent->left;
+            }
+            if (rb_is_black(sib->left) && rb_is_black(sib->right)) {
+                sib->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (rb_is_black(sib->left)) {
+                sib->right->color = RB_BLACK;
+                sib->color = RB_RED;
+                rb_rotate_left(tree, sib);
+                sib = parent->left;
+            }
+            sib->color = parent->color;
+            parent->color = RB_BLACK;
+            sib->left->color = RB_BLACK;
+            rb_rotate_right(tree, parent);
+            node = tree->root;
+        }
+    }
+
+    if (node)
+        node->color = RB_BLACK;
+}
+
+void rb_erase(rb_tree_t *tree, rb_node_t *node) {
+    rb_node_t *child, *parent;
+    int color;
+
+    if (node->left && node->right) {
+        // the successor leaves its slot and takes the place of node
+        rb_node_t *succ = node->right;
+        while (succ->left)
+            succ = succ->left;
+
+        child = succ->right;
+        parent = succ->parent;
+        color = succ->color;
+
+        if (parent == node) {
+            parent = succ;
+        }
+        else {
+            parent->left = child;
+            if (child)
+                child->parent = parent;
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = node->parent;
+        succ->color = node->color;
+        rb_change_child(tree, node, succ, node->parent);
+    }
+    else {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child)
+            child->parent = parent;
+        rb_change_child(tree, node, child, parent);
+    }
+
+    tree->size--;
+    if (color == RB_BLACK)
+        rb_erase_fixup(tree, child, parent);
+}
+
+void rb_replace(rb_tree_t *tree, rb_node_t *node, rb_node_t *nnode) {
+    *nnode = *node;
+    if (node->left)
+        node->left->parent = nnode;
+    if (node->right)
+        node->right->parent = nnode;
+    rb_change_child(tree, node, nnode, node->parent);
+}
+
+rb_node_t *rb_lower_bound(rb_tree_t *tree, rb_pred_t func, void *arg) {
+    rb_node_t *node = tree->root, *found = NULL;
+
+    while (node) {
+        if (func(node, arg)) {
+            found = node;
+            node = node->left;
+        }
+        else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+rb_node_t *rb_first(rb_tree_t *tree) {
+    rb_node_t *node = tree->root;
+    if (node) {
+        while (node->left)
+            node = node->left;
+    }
+    return node;
+}
+
+rb_node_t *rb_next(rb_node_t *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+
+#define RBTREE_ASSERT(con) ({\
+    if (!(con)) {\
+        cprintf("rbtree assertion fail.\n"#con"\n");\
+        while (1);\
+    }\
+})
+
+typedef struct {
+    rb_node_t tag;
+    uint32_t key;
+} rb_test_t;
+
+#define node2test(n)    (elem2entry(rb_test_t, tag, n))
+
+static bool rb_test_less(rb_node_t *a, rb_node_t *b) {
+    return node2test(a)->key < node2test(b)->key;
+}
+
+static bool rb_test_ge(rb_node_t *n, void *arg) {
+    return node2test(n)->key >= (uint32_t)arg;
+}
+
+// black height of the subtree, -1 if a rule is broken
+static int rb_test_height(rb_node_t *n) {
+    if (n == NULL)
+        return 1;
+    if (rb_is_red(n) && (rb_is_red(n->left) || rb_is_red(n->right)))
+        return -1;
+    if ((n->left && n->left->parent != n) ||
+                                (n->right && n->right->parent != n))
+        return -1;
+
+    int l = rb_test_height(n->left), r = rb_test_height(n->right);
+    if (l < 0 || l != r)
+        return -1;
+    return l + (n->color == RB_BLACK);
+}
+
+static void rb_test_verify(rb_tree_t *tree) {
+    RBTREE_ASSERT(rb_is_black(tree->root));
+    RBTREE_ASSERT(rb_test_height(tree->root) > 0);
+
+    uint32_t n = 0, last = 0;
+    for (rb_node_t *it = rb_first(tree); it; it = rb_next(it), ++n) {
+        RBTREE_ASSERT(n == 0 || node2test(it)->key >= last);
+        last = node2test(it)->key;
+    }
+    RBTREE_ASSERT(n == tree->size);
+}
+
+void check_rbtree(void) {
+    static rb_test_t nodes[64], spare;
+    rb_tree_t tree;
+    rb_tree_init(&tree);
+
+    // keys 0, 2, .. 126 in a scrambled order
+    for (uint32_t i=0; i<64; ++i) {
+        nodes[i].key = ((i * 37) & 63) * 2;
+        rb_insert(&tree, &nodes[i].tag, rb_test_less);
+        rb_test_verify(&tree);
+    }
+
+    RBTREE_ASSERT(node2test(rb_first(&tree))->key == 0);
+    RBTREE_ASSERT(node2test(rb_lower_bound(&tree, rb_test_ge,
+                                            (void*)51))->key == 52);
+    RBTREE_ASSERT(rb_lower_bound(&tree, rb_test_ge, (void*)127) == NULL);
+
+    spare.key = nodes[5].key;
+    rb_replace(&tree, &nodes[5].tag, &spare.tag);
+    rb_test_verify(&tree);
+    RBTREE_ASSERT(rb_lower_bound(&tree, rb_test_ge,
+                                        (void*)spare.key) == &spare.tag);
+
+    for (uint32_t i=0; i<64; i += 2) {
+        rb_erase(&tree, &nodes[i].tag);
+        rb_test_verify(&tree);
+    }
+    for (uint32_t i=1; i<64; i += 2) {
+        rb_erase(&tree, i == 5 ? &spare.tag : &nodes[i].tag);
+        rb_test_verify(&tree);
+    }
+    RBTREE_ASSERT(tree.root == NULL && tree.size == 0);
+}
+
+#undef RBTREE_ASSERT
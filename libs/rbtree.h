@@ -0,0 +1,50 @@
+#ifndef __L_RBTREE_H
+#define __L_RBTREE_H
+
+#include <types.h>
+#include <list.h>
+
+/*
+侵入式红黑树, 节点嵌在宿主结构里, 用 elem2entry 取回宿主
+树不保存键, 插入时用 less 比较两个节点, 查找用单调的谓词,
+返回第一个使谓词为真的节点, 与 list_traversal 的用法一致
+*/
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+} rb_node_t;
+
+typedef struct rb_tree {
+    rb_node_t *root;
+    uint32_t size;
+} rb_tree_t;
+
+typedef bool (rb_less_t)(rb_node_t *a, rb_node_t *b);
+
+typedef bool (rb_pred_t)(rb_node_t *node, void *arg);
+
+void rb_tree_init(rb_tree_t *tree);
+
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_less_t less);
+
+void rb_erase(rb_tree_t *tree, rb_node_t *node);
+
+// put nnode where node is, the order must not change
+void rb_replace(rb_tree_t *tree, rb_node_t *node, rb_node_t *nnode);
+
+// first node in order that func holds for, func false then true in order
+rb_node_t *rb_lower_bound(rb_tree_t *tree, rb_pred_t func, void *arg);
+
+rb_node_t *rb_first(rb_tree_t *tree);
+
+rb_node_t *rb_next(rb_node_t *node);
+
+void check_rbtree(void);
+
+#endif
@@ -139,6 +139,74 @@ rcr3(void) {
     return cr3;
 }
 
+static inline void
+lcr4(uint32_t cr4) {
+    asm volatile ("mov %0, %%cr4" :: "r" (cr4) : "memory");
+}
+
+static inline uint32_t
+rcr4(void) {
+    uint32_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r" (cr4) :: "memory");
+    return cr4;
+}
+
+static inline void
+cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp,
+                                    uint32_t *ecxp, uint32_t *edxp) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid"
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (info));
+    if (eaxp) *eaxp = eax;
+    if (ebxp) *ebxp = ebx;
+    if (ecxp) *ecxp = ecx;
+    if (edxp) *edxp = edx;
+}
+
+// cpuid_count - cpuid of a leaf with sub-leaves, sub goes in ecx
+static inline void
+cpuid_count(uint32_t info, uint32_t sub, uint32_t *eaxp, uint32_t *ebxp,
+                                    uint32_t *ecxp, uint32_t *edxp) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid"
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (info), "c" (sub));
+    if (eaxp) *eaxp = eax;
+    if (ebxp) *ebxp = ebx;
+    if (ecxp) *ecxp = ecx;
+    if (edxp) *edxp = edx;
+}
+
+static inline uint64_t
+rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val) {
+    asm volatile ("wrmsr" :: "c" (msr), "a" ((uint32_t)val),
+                                            "d" ((uint32_t)(val >> 32)));
+}
+
+// bsr - index of the highest set bit, x must not be 0
+static inline uint32_t
+bsr(uint32_t x) {
+    uint32_t r;
+    asm ("bsrl %1, %0" : "=r" (r) : "rm" (x));
+    return r;
+}
+
+// bsf - index of the lowest set bit, x must not be 0
+static inline uint32_t
+bsf(uint32_t x) {
+    uint32_t r;
+    asm ("bsfl %1, %0" : "=r" (r) : "rm" (x));
+    return r;
+}
+
 static inline void
 invlpg(void *addr) {
     asm volatile ("invlpg (%0)" :: "r" (addr) : "memory");